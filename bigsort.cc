@@ -24,14 +24,24 @@
 #include <seastar/core/file.hh>
 #include <seastar/core/sleep.hh>
 #include <seastar/core/memory.hh>
+#include <seastar/core/smp.hh>
+#include <seastar/core/posix.hh>
+#include <seastar/core/prometheus.hh>
+#include <seastar/http/httpd.hh>
 #include <boost/program_options.hpp>
 #include <boost/iterator/counting_iterator.hpp>
 #include <iostream>
+#include <fstream>
 #include <chrono>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "sort_strategies.hh"
 #include "file_utils.hh"
 #include "block.hh"
+#include "sort_metrics.hh"
 
 
 void handle_eptr(std::exception_ptr eptr)
@@ -45,18 +55,115 @@ void handle_eptr(std::exception_ptr eptr)
     }
 }
 
+// standard input or output as a stream polled by the reactor, a pipe or a socket.
+// The reactor polls a duplicate of fd, fd stays open and gets back its flags when the stream is released
+class standard_stream
+{
+public:
+    explicit standard_stream(int fd):_fd(fd), _flags(-1)
+    {
+        struct stat st;
+        if(::fstat(fd, &st) < 0)
+            throw std::system_error(errno, std::system_category(), "can't stat the standard stream " + std::to_string(fd));
+        if(!S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+            throw std::invalid_argument("the standard stream " + std::to_string(fd) + " is not a pipe or a socket, it can't be polled");
+        _flags = ::fcntl(fd, F_GETFL);
+        // the flags belong to the open file, they are shared by the duplicate
+        if(_flags < 0 || ::fcntl(fd, F_SETFL, _flags | O_NONBLOCK) < 0)
+            throw std::system_error(errno, std::system_category(), "can't poll the standard stream " + std::to_string(fd));
+        const int polled = ::dup(fd);
+        if(polled < 0){
+            const int err = errno;
+            ::fcntl(fd, F_SETFL, _flags);
+            throw std::system_error(err, std::system_category(), "can't duplicate the standard stream " + std::to_string(fd));
+        }
+        _stream = std::make_unique<seastar::pollable_fd>(seastar::file_desc::from_fd(polled));
+    }
+    ~standard_stream()
+    {
+        ::fcntl(_fd, F_SETFL, _flags);
+    }
+    standard_stream(const standard_stream&) = delete;
+    standard_stream& operator=(const standard_stream&) = delete;
+
+    seastar::pollable_fd& stream() { return *_stream; }
+private:
+    int _fd;
+    int _flags;
+    std::unique_ptr<seastar::pollable_fd> _stream;
+};
+
+// register the metrics on all the shards and export them on port by the prometheus endpoint, 0 doesn't export them
+seastar::future<> start_metrics(std::shared_ptr<seastar::httpd::http_server_control> server, uint16_t port)
+{
+    return seastar::smp::invoke_on_all([]{
+        sort_metrics::register_metrics();
+    }).then([server, port]{
+        if(!port)
+            return seastar::make_ready_future<>();
+        // the metrics are in the group bigsort, they are exported as seastar_bigsort_* next to the metrics of seastar
+        seastar::prometheus::config config;
+        return server->start("prometheus").then([server, config]{
+            return seastar::prometheus::start(*server, config);
+        }).then([server, port]{
+            return server->listen(seastar::socket_address(seastar::ipv4_addr(port)));
+        }).then([port]{
+            std::cout << "prometheus metrics on port " << port << std::endl;
+        });
+    });
+}
+
+// write the JSON summary of the metrics of all the shards to path, an empty path doesn't write it
+seastar::future<> write_metrics_summary(seastar::sstring path)
+{
+    if(path.empty())
+        return seastar::make_ready_future<>();
+    return sort_metrics::json_summary().then([path](seastar::sstring summary){
+        std::ofstream out(path.c_str());
+        out << summary;
+        if(!out)
+            throw std::runtime_error("can't write the metrics summary to " + std::string(path.c_str()));
+        std::cout << "metrics summary written to " << path << std::endl;
+    });
+}
+
 int main(int argc, char** argv) {
     namespace bpo = boost::program_options;
     seastar::app_template app;
     app.add_options()
-        ("mem", boost::program_options::value<size_t>()->default_value(1000), "Memory available for internal sort expressed in MB");
+        ("mem", boost::program_options::value<size_t>()->default_value(1000), "Memory available for internal sort expressed in MB")
+        ("partitions", boost::program_options::value<size_t>()->default_value(2), "Number of partitions sharing --mem, a partition is read while the others are sorted and written")
+        ("scan", boost::program_options::value<bool>()->default_value(true), "Scan the file before sorting it, a sorted or reverse sorted file is copied instead of sorted")
+        ("runs", boost::program_options::value<seastar::sstring>()->default_value("partition"), "Sorted files generator: partition (sort partitions of memory size) or replacement (replacement selection, longer sorted files)")
+        ("spill", boost::program_options::value<seastar::sstring>()->default_value("raw"), "Format of the sorted files: raw (4K blocks) or front-coded (blocks coded against their predecessor)")
+        ("spill-ratio", boost::program_options::value<double>()->default_value(0.8), "A front coded sorted file is written raw when its size is over this ratio of the raw size")
+        ("key-pointer", boost::program_options::value<bool>()->default_value(false), "Write the sorted files as key records pointing to the blocks, merge them to a permutation and copy the blocks in its order")
+        ("permutation-only", boost::program_options::value<bool>()->default_value(false), "With --key-pointer write only filename.permutation, the index of any block in sorted order")
+        ("record-size", boost::program_options::value<size_t>()->default_value(4096), "Size of the records sorted in bytes, a power of two from 8 to 4096. Smaller records are packed many per 4K block")
+        ("key", boost::program_options::value<seastar::sstring>()->default_value("all"), "Key of the blocks as comma separated fields offset:length[:desc], e.g. 16:32,48:8:desc. all is the whole block")
+        ("sort", boost::program_options::value<seastar::sstring>()->default_value("prefix"), "Internal sort algorithm: stable (compare whole blocks), prefix (sort key prefixes, compare blocks on ties) or radix (MSD radix sort)")
+        ("read-ahead", boost::program_options::value<size_t>()->default_value(0), "Read-ahead window of any sorted file during merge expressed in KB, 0 adapt it to memory and files count")
+        ("fan-in", boost::program_options::value<size_t>()->default_value(0), "Max number of sorted files merged together, more sorted files are merged in several passes. 0 bound it by memory only")
+        ("write-buffer", boost::program_options::value<size_t>()->default_value(4), "Size of any write of the sorted file expressed in MB")
+        ("flush-interval", boost::program_options::value<size_t>()->default_value(0), "Flush the sorted file every interval expressed in MB, 0 flush only at the end")
+        ("read-extent", boost::program_options::value<size_t>()->default_value(4), "Size of any read of the file to be sorted expressed in MB")
+        ("read-depth", boost::program_options::value<size_t>()->default_value(4), "Max number of reads in flight of the file to be sorted")
+        ("prometheus-port", boost::program_options::value<uint16_t>()->default_value(0), "Export the metrics by the prometheus endpoint on this port, 0 doesn't export them")
+        ("metrics-json", boost::program_options::value<seastar::sstring>()->default_value(""), "Write a JSON summary of the metrics of the sort to this file")
+        ("verify", boost::program_options::value<bool>()->default_value(false), "Don't sort, verify that filename.sorted is sorted and is a permutation of filename. The exit code is 1 when it isn't")
+        ("limit", boost::program_options::value<uint64_t>()->default_value(0), "Write only the first N blocks of the sorted order, 0 writes all the blocks. N blocks that fit --mem are kept by a bounded heap while the file is read")
+        ("stdout", boost::program_options::value<bool>()->default_value(false), "Stream the sorted blocks to the standard output, a pipe or a socket, instead of writing filename.sorted. The messages go to the standard error")
+        ("stream-name", boost::program_options::value<seastar::sstring>()->default_value("stdin"), "When filename is - the blocks are read from the standard input, a pipe or a socket, and this name replaces filename");
     boost::program_options::positional_options_description positional_opt;
     app.add_positional_options({
        { "filename", bpo::value<seastar::sstring>(),
-         "file to be sorted", -1}
+         "file to be sorted, - reads the standard input", -1}
     });
 
-    app.run(argc, argv, [&app]{
+    int exit_code = 0;
+    // --stdout sends the messages to the standard error, the buffer of std::cout is restored at exit
+    std::streambuf* cout_buffer = std::cout.rdbuf();
+    const int ret = app.run(argc, argv, [&app, &exit_code]{
         auto& args = app.configuration();
 
         if (!args.count("filename")){
@@ -64,47 +171,199 @@ int main(int argc, char** argv) {
             return seastar::make_ready_future<>();
         }
 
-        static datablock::blocks_vector blocks;
-        static size_t free_mem = seastar::memory::stats().free_memory()/2;
-
-        static seastar::sstring filename = (args["filename"].as<seastar::sstring>());
-        static int file_index = 0;
-        static uint64_t blocks_fetched = 0;
-        static std::chrono::time_point<std::chrono::system_clock> start_time = std::chrono::system_clock::now();
-
-        std::cout << "bigsort lexicographic sort of 4K blocks.\nAvailable memory for internal sort " << free_mem/1024/1024 << " Mb\nfile name " << filename << std::endl;
-
-        return file_utils::read_blocks_from_file(filename, [](datablock::blocks_ptr &&block, uint64_t block_index, uint64_t blocks_tot){
-            blocks.push_back(std::move(block));
-            ++blocks_fetched;
-            if(blocks.size() * block_size >= free_mem || blocks_fetched == blocks_tot){
-                //sort and save to disk
-                datablock::sort_blocks(blocks);
-                return file_utils::write_blocks(blocks, filename + "." + std::to_string(++file_index))
-                .then([blocks_tot]() mutable {
-                    std::cout << "write " << blocks.size() << " blocks on disk -- file " <<  filename + "." + std::to_string(file_index) << std::endl;
-                    std::vector<datablock::blocks_ptr>().swap(blocks); //delete memory blocks
-                    if(blocks_fetched == blocks_tot)
-                    {
-                        std::cout << "internal sort done in "
-                                  <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count()
-                                  << "ms" << std::endl;
-                        start_time = std::chrono::system_clock::now();
-                        return sort_algorithm::external_sort(filename, file_index).then([]{
-                            std::cout << "externa sort sort done in "
-                                        <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count()
-                                        << "ms" << std::endl;
-                            return seastar::make_ready_future();
-                        });
-                    }
-                    return seastar::make_ready_future();
+        // memory is split among shards, any shard sorts its range of the file
+        const size_t free_mem = args["mem"].as<size_t>()*1024*1024;
+        sort_algorithm::run_options run_opts;
+        run_opts.memory = free_mem;
+        run_opts.partitions = std::max<size_t>(args["partitions"].as<size_t>(), 1);
+        run_opts.keep_last = true;
+        run_opts.key_pointer = args["key-pointer"].as<bool>();
+        run_opts.limit = args["limit"].as<uint64_t>();
+        if(run_opts.key_pointer && run_opts.limit){
+            std::cout << "--limit can't be used with --key-pointer" << '\n';
+            return seastar::make_ready_future<>();
+        }
+        const bool permutation_only = run_opts.key_pointer && args["permutation-only"].as<bool>();
+        run_opts.input.extent_size = std::max<size_t>(args["read-extent"].as<size_t>(), 1)*1024*1024;
+        run_opts.input.queue_depth = std::max<size_t>(args["read-depth"].as<size_t>(), 1);
+
+        if(args["runs"].as<seastar::sstring>() == "replacement")
+            run_opts.generator = sort_algorithm::run_generator::replacement;
+        else if(args["runs"].as<seastar::sstring>() != "partition"){
+            std::cout << "unknown sorted files generator " << args["runs"].as<seastar::sstring>() << '\n';
+            return seastar::make_ready_future<>();
+        }
+        if(run_opts.key_pointer && run_opts.generator == sort_algorithm::run_generator::replacement){
+            std::cout << "--key-pointer sorts partitions of memory size, it can't be used with --runs replacement" << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        try {
+            datablock::set_record_size(args["record-size"].as<size_t>());
+        } catch(const std::exception& e) {
+            std::cout << "invalid record size " << args["record-size"].as<size_t>() << ": " << e.what() << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        try {
+            datablock::set_key_spec(datablock::key_spec::parse(args["key"].as<seastar::sstring>()));
+        } catch(const std::exception& e) {
+            std::cout << "invalid key " << args["key"].as<seastar::sstring>() << ": " << e.what() << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        if(args["spill"].as<seastar::sstring>() == "front-coded")
+            run_opts.spill = datablock::spill_format::front_coded;
+        else if(args["spill"].as<seastar::sstring>() != "raw"){
+            std::cout << "unknown sorted files format " << args["spill"].as<seastar::sstring>() << '\n';
+            return seastar::make_ready_future<>();
+        }
+        run_opts.max_spill_ratio = args["spill-ratio"].as<double>();
+
+        if(args["sort"].as<seastar::sstring>() == "stable")
+            run_opts.mode = datablock::sort_mode::stable;
+        else if(args["sort"].as<seastar::sstring>() == "radix")
+            run_opts.mode = datablock::sort_mode::radix;
+        else if(args["sort"].as<seastar::sstring>() != "prefix"){
+            std::cout << "unknown sort algorithm " << args["sort"].as<seastar::sstring>() << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        // any shard merges its key range of the sorted files using its share of memory
+        sort_algorithm::sort_options sort_opts;
+        sort_opts.memory = std::min(free_mem / seastar::smp::count, seastar::memory::stats().free_memory()/2);
+        sort_opts.read_ahead = args["read-ahead"].as<size_t>()*1024;
+        sort_opts.max_fan_in = args["fan-in"].as<size_t>();
+        sort_opts.limit = run_opts.limit;
+        sort_opts.output.buffer_size = std::max<size_t>(args["write-buffer"].as<size_t>(), 1)*1024*1024;
+        sort_opts.output.flush_interval = args["flush-interval"].as<size_t>()*1024*1024;
+
+        const seastar::sstring filename = (args["filename"].as<seastar::sstring>());
+        const auto start_time = std::chrono::system_clock::now();
+
+        // the sorted files of the standard input are named by --stream-name
+        const bool stream_input = filename == "-";
+        const bool stream_output = args["stdout"].as<bool>();
+        const seastar::sstring root_filename = stream_input ? args["stream-name"].as<seastar::sstring>() : filename;
+        if(stream_output)
+            std::cout.rdbuf(std::cerr.rdbuf());
+        if((stream_input || stream_output) && run_opts.key_pointer){
+            std::cout << "--key-pointer reads the blocks again from the file, it can't read the standard input or write the standard output" << '\n';
+            return seastar::make_ready_future<>();
+        }
+        if(stream_input && args["verify"].as<bool>()){
+            std::cout << "--verify reads the file to be sorted again, it can't read the standard input" << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        if(args["verify"].as<bool>()){
+            std::cout << "bigsort verify of " << filename << ".sorted on " << seastar::smp::count << " shards" << std::endl;
+            return sort_algorithm::verify_sorted(filename, filename + ".sorted", run_opts.input).then([start_time, &exit_code](sort_algorithm::verify_result result){
+                if(result.sorted())
+                    std::cout << "sorted: " << result.output_blocks << " records" << std::endl;
+                else
+                    std::cout << "NOT sorted: record " << result.first_unsorted << " is smaller than the previous one" << std::endl;
+                std::cout << (result.permutation ? "permutation of the input: " : "NOT a permutation of the input: ")
+                          << result.input_blocks << " input records -- " << result.output_blocks << " sorted records" << std::endl;
+                std::cout << "verify done in "
+                          <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count()
+                          << "ms" << std::endl;
+                exit_code = result.ok() ? 0 : 1;
+            }).handle_exception([&exit_code](std::exception_ptr e) {
+                handle_eptr(e);
+                exit_code = 1;
+            });
+        }
+
+        std::cout << "bigsort lexicographic sort of " << datablock::record_size << " bytes records by a key of " << datablock::active_key_spec().size() << " bytes.\nAvailable memory for internal sort " << free_mem/1024/1024 << " Mb on "
+                  << seastar::smp::count << " shards\nfile name " << (stream_input ? "standard input" : filename)
+                  << " -- sorted to " << (stream_output ? "standard output" : root_filename + ".sorted")
+                  << "\ncompare kernel " << datablock::active_compare_kernel().name
+                  << " -- record compare kernel " << datablock::record_compare_name() << std::endl;
+        if(run_opts.limit)
+            std::cout << "keep the first " << run_opts.limit << " blocks of the sorted order" << std::endl;
+
+        const uint16_t prometheus_port = args["prometheus-port"].as<uint16_t>();
+        const seastar::sstring metrics_json = args["metrics-json"].as<seastar::sstring>();
+        auto prometheus_server = std::make_shared<seastar::httpd::http_server_control>();
+
+        // a presorted file is found by a scan that stops at the first blocks of an unsorted file
+        // the permutation of a presorted file is not written by the copy
+        // a stream can't be scanned before sorting it and the copy of a presorted file is written to a file
+        const bool scan_input = args["scan"].as<bool>() && !permutation_only && !stream_input && !stream_output;
+        std::shared_ptr<standard_stream> input;
+        std::shared_ptr<standard_stream> output;
+        try {
+            input = stream_input ? std::make_shared<standard_stream>(0) : nullptr;
+            output = stream_output ? std::make_shared<standard_stream>(1) : nullptr;
+        } catch(const std::exception& e) {
+            std::cout << e.what() << '\n';
+            return seastar::make_ready_future<>();
+        }
+        return start_metrics(prometheus_server, prometheus_port).then([filename, run_opts, scan_input]{
+            return scan_input ? sort_algorithm::scan_input_order(filename, run_opts.input)
+                              : seastar::make_ready_future<sort_algorithm::input_order>(sort_algorithm::input_order::unsorted);
+        }).then([filename, root_filename, input, output, run_opts, sort_opts, start_time, permutation_only](sort_algorithm::input_order order){
+            if(order != sort_algorithm::input_order::unsorted){
+                std::cout << "the file is " << (order == sort_algorithm::input_order::ascending ? "sorted" : "reverse sorted")
+                          << ", copy it" << std::endl;
+                return sort_algorithm::copy_presorted(filename, order, run_opts.input, sort_opts).then([start_time]{
+                    std::cout << "copy done in "
+                              <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count()
+                              << "ms" << std::endl;
                 });
             }
-            return seastar::make_ready_future();
-        }).then([]{}).handle_exception([](std::exception_ptr e) {
+
+            auto sorted_runs = seastar::make_ready_future<std::vector<sort_algorithm::run_info>>();
+            if(input){
+                // the standard input is read by this shard only, using its share of memory
+                sort_algorithm::run_options stream_opts = run_opts;
+                stream_opts.memory = std::min(run_opts.memory / seastar::smp::count, seastar::memory::stats().free_memory() / 2);
+                sorted_runs = sort_algorithm::stream_internal_sort(input->stream(), root_filename + ".0", stream_opts);
+            }else{
+                sorted_runs = sort_algorithm::parallel_internal_sort(filename, run_opts);
+            }
+            return sorted_runs.then([filename, root_filename, input, output, run_opts, sort_opts, start_time, permutation_only](std::vector<sort_algorithm::run_info> runs){
+                std::cout << "internal sort done in "
+                          <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count()
+                          << "ms -- " << runs.size() << " sorted files" << std::endl;
+                const auto merge_time = std::chrono::system_clock::now();
+                if(run_opts.key_pointer){
+                    return sort_algorithm::key_pointer_merge(filename, std::move(runs), sort_opts).then([filename, run_opts, sort_opts, merge_time, permutation_only]{
+                        std::cout << "permutation done in "
+                                  <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - merge_time).count()
+                                  << "ms" << std::endl;
+                        if(permutation_only)
+                            return seastar::make_ready_future<>();
+                        return sort_algorithm::gather_blocks(filename, sort_opts, run_opts.input);
+                    });
+                }
+                if(output){
+                    return sort_algorithm::external_sort(root_filename, std::move(runs), output->stream(), sort_opts).then([merge_time, output]{
+                        std::cout << "external sort to the standard output done in "
+                                  <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - merge_time).count()
+                                  << "ms" << std::endl;
+                    });
+                }
+                return sort_algorithm::parallel_external_sort(root_filename, std::move(runs), sort_opts).then([merge_time]{
+                    std::cout << "externa sort sort done in "
+                                <<  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - merge_time).count()
+                                << "ms" << std::endl;
+                });
+            });
+        }).then([metrics_json]{
+            return write_metrics_summary(metrics_json);
+        }).handle_exception([](std::exception_ptr e) {
             handle_eptr(e);
+        }).finally([prometheus_server, prometheus_port]{
+            return prometheus_port ? prometheus_server->stop() : seastar::make_ready_future<>();
+        }).finally([]{
+            return seastar::smp::invoke_on_all([]{
+                sort_metrics::unregister_metrics();
+            });
         });
     });
 
-    return 0;
+    std::cout.rdbuf(cout_buffer);
+    return ret ? ret : exit_code;
 }
@@ -20,18 +20,296 @@
  */
 
 #include "block.hh"
+#include <seastar/core/thread.hh>
+#include <stdexcept>
+#include <string>
 
 int const block_size(4096);
 
 namespace datablock{
 
+size_t record_size(block_size);
+
+static int compare_record_bytes(const unsigned char* a, const unsigned char* b)
+{
+    return compare_bytes(a, b, record_size);
+}
+
+static const fixed_compare_kernel* record_kernel = find_fixed_compare_kernel(block_size);
+
+compare_fixed_fn record_compare = record_kernel ? record_kernel->compare : compare_record_bytes;
+
+void set_record_size(size_t size)
+{
+    if(size < 8 || size > static_cast<size_t>(block_size) || (size & (size - 1)) != 0)
+        throw std::invalid_argument("record size must be a power of two from 8 to " + std::to_string(block_size));
+    record_size = size;
+    record_kernel = find_fixed_compare_kernel(size);
+    record_compare = record_kernel ? record_kernel->compare : compare_record_bytes;
+}
+
+const char* record_compare_name()
+{
+    return record_kernel ? record_kernel->name : active_compare_kernel().name;
+}
+
 void sort_blocks(blocks_vector &blocks)
 {
     std::stable_sort(blocks.begin(),
         blocks.end(),
         [](const blocks_ptr& a, const blocks_ptr& b){
-            return std::lexicographical_compare(a.get(), a.get() + block_size, b.get(), b.get() + block_size);
+            return compare_blocks(a.get(), b.get()) < 0;
         });
 }
 
-}
\ No newline at end of file
+static thread_local uint64_t shard_sort_compares = 0;
+
+// Preemption point of the sorts. A sort running in a seastar thread yields once the task quota is over, so the reactor
+// keeps serving the reads and the writes in flight; out of a thread the sort runs to the end.
+// The compares are summed to the compares of the shard when the sort is done.
+class preemption_point
+{
+public:
+    preemption_point():_in_thread(seastar::thread::running_in_thread()){}
+
+    ~preemption_point() {
+        shard_sort_compares += _compares;
+    }
+
+    void operator()() {
+        if(_in_thread && ++_count % preemption_check_interval == 0)
+            seastar::thread::maybe_yield();
+    }
+
+    // a compare of the sort is a preemption point as well
+    void compare() {
+        ++_compares;
+        (*this)();
+    }
+
+private:
+    bool _in_thread;
+    unsigned _count = 0;
+    uint64_t _compares = 0;
+};
+
+uint64_t sort_compares()
+{
+    return shard_sort_compares;
+}
+
+// key prefix of a block and its slot in the arena
+struct prefix_entry
+{
+    uint64_t prefix;
+    uint32_t slot;
+};
+
+// buckets smaller than this are sorted by compare
+const size_t radix_small_bucket(64);
+
+// bucket of the radix sort: order[begin, begin + count) share the first depth bytes
+struct radix_bucket
+{
+    size_t begin;
+    size_t count;
+    size_t depth;
+};
+
+// Stable MSD radix sort of the arena order on the keys key_of(slot) of key_len bytes.
+// Any bucket is distributed by the byte at its depth through an auxiliary index array, then the sub buckets
+// are sorted at depth + 1. Before distributing, the common prefix of the bucket is skipped at once
+// since long common prefixes are common (e.g. genbigfile patterns) and any of these bytes would produce a single bucket.
+template <typename KeyOf>
+static void radix_sort(block_arena &arena, KeyOf key_of, size_t key_len)
+{
+    preemption_point preempt;
+    auto& order = arena.order();
+    std::vector<uint32_t> aux(order.size());
+    std::vector<radix_bucket> buckets;
+    buckets.push_back(radix_bucket{0, order.size(), 0});
+
+    while(!buckets.empty()){
+        preempt();
+        radix_bucket bucket = buckets.back();
+        buckets.pop_back();
+        auto first = order.begin() + bucket.begin;
+        auto last = first + bucket.count;
+
+        if(bucket.count < radix_small_bucket){
+            const size_t depth = bucket.depth;
+            std::stable_sort(first, last, [&key_of, &preempt, depth, key_len](uint32_t a, uint32_t b){
+                preempt.compare();
+                return compare_bytes(key_of(a) + depth, key_of(b) + depth, key_len - depth) < 0;
+            });
+            continue;
+        }
+
+        // skip the common prefix of the bucket
+        const unsigned char* pivot = key_of(*first);
+        size_t common_end = key_len;
+        // the passes over a large bucket are preemption points as well
+        for(auto it = first + 1; it != last && common_end > bucket.depth; ++it){
+            preempt();
+            const unsigned char* x = key_of(*it);
+            common_end = std::mismatch(pivot + bucket.depth, pivot + common_end, x + bucket.depth).first - pivot;
+        }
+        if(common_end == key_len)
+            continue; // all keys are equal
+
+        const size_t depth = common_end;
+        size_t counts[256] = {0};
+        for(auto it = first; it != last; ++it){
+            preempt();
+            ++counts[key_of(*it)[depth]];
+        }
+
+        size_t offsets[256];
+        size_t offset = 0;
+        for(int b = 0; b < 256; ++b){
+            offsets[b] = offset;
+            offset += counts[b];
+        }
+
+        for(auto it = first; it != last; ++it){
+            preempt();
+            aux[offsets[key_of(*it)[depth]]++] = *it;
+        }
+        for(size_t i = 0; i < bucket.count; ++i){
+            preempt();
+            first[i] = aux[i];
+        }
+
+        if(depth + 1 == key_len)
+            continue;
+        size_t begin = bucket.begin;
+        for(int b = 0; b < 256; ++b){
+            if(counts[b] > 1)
+                buckets.push_back(radix_bucket{begin, counts[b], depth + 1});
+            begin += counts[b];
+        }
+    }
+}
+
+static void radix_sort(block_arena &arena)
+{
+    const key_spec& spec = active_key_spec();
+    if(spec.whole_block()){
+        radix_sort(arena, [&arena](uint32_t slot){ return const_cast<const block_arena&>(arena).slot(slot); }, record_size);
+        return;
+    }
+
+    // the radix passes run on the normalized keys, a key per slot
+    const size_t key_len = spec.size();
+    std::vector<unsigned char> keys(arena.size() * key_len);
+    preemption_point preempt;
+    for(uint32_t slot = 0; slot < arena.size(); ++slot){
+        preempt();
+        spec.normalize(const_cast<const block_arena&>(arena).slot(slot), keys.data() + slot * key_len, key_len);
+    }
+    radix_sort(arena, [&keys, key_len](uint32_t slot){ return keys.data() + static_cast<size_t>(slot) * key_len; }, key_len);
+}
+
+// Reuse the natural runs of the partition: descending runs are reversed and the runs are merged.
+// Returns false when the runs are too short to be worth it, the scan stops as soon as the runs found exceed
+// the budget so random partitions pay few compares. The descending runs found by then are left reversed,
+// they have no equal blocks so the sort that follows is still stable.
+static bool merge_natural_runs(block_arena &arena)
+{
+    auto& order = arena.order();
+    const size_t n = order.size();
+    const size_t max_runs = std::max<size_t>(n / natural_run_min_size, 1);
+    preemption_point preempt;
+    auto less = [&arena, &preempt](uint32_t a, uint32_t b){
+        preempt.compare();
+        return compare_blocks(arena.slot(a), arena.slot(b)) < 0;
+    };
+
+    // bounds of the runs, a descending run is strictly descending so reversing it keeps equal blocks stable
+    std::vector<size_t> bounds(1, 0);
+    size_t begin = 0;
+    while(begin < n){
+        size_t end = begin + 1;
+        if(end < n && less(order[end], order[begin])){
+            while(end < n && less(order[end], order[end - 1]))
+                ++end;
+            std::reverse(order.begin() + begin, order.begin() + end);
+        }else{
+            while(end < n && !less(order[end], order[end - 1]))
+                ++end;
+        }
+        bounds.push_back(end);
+        begin = end;
+        // too many short runs, the partition is sorted as usual.
+        // the reversed runs have no equal blocks, so they don't change the order of equal blocks
+        if(bounds.size() - 1 > max_runs && begin < n)
+            return false;
+    }
+
+    // merge adjacent runs pairwise, stable as any run precedes the next in input order
+    while(bounds.size() > 2){
+        std::vector<size_t> merged(1, 0);
+        for(size_t r = 0; r + 1 < bounds.size(); r += 2){
+            if(r + 2 < bounds.size()){
+                std::inplace_merge(order.begin() + bounds[r], order.begin() + bounds[r + 1], order.begin() + bounds[r + 2], less);
+                merged.push_back(bounds[r + 2]);
+            }else{
+                merged.push_back(bounds[r + 1]);
+            }
+        }
+        bounds.swap(merged);
+    }
+    return true;
+}
+
+void sort_blocks(block_arena &arena, sort_mode mode)
+{
+    if(merge_natural_runs(arena))
+        return;
+
+    if(mode == sort_mode::radix){
+        radix_sort(arena);
+        return;
+    }
+
+    preemption_point preempt;
+    auto& order = arena.order();
+    if(mode == sort_mode::stable){
+        std::stable_sort(order.begin(),
+            order.end(),
+            [&arena, &preempt](uint32_t a, uint32_t b){
+                preempt.compare();
+                return compare_blocks(arena.slot(a), arena.slot(b)) < 0;
+            });
+        return;
+    }
+
+    // sort the cache resident key prefixes, blocks are read only when prefixes are equal
+    std::vector<prefix_entry> entries;
+    entries.reserve(order.size());
+    for(auto slot:order){
+        preempt();
+        entries.push_back(prefix_entry{block_prefix(arena.slot(slot)), slot});
+    }
+
+    std::stable_sort(entries.begin(),
+        entries.end(),
+        [&arena, &preempt](const prefix_entry& a, const prefix_entry& b){
+            preempt.compare();
+            if(a.prefix != b.prefix)
+                return a.prefix < b.prefix;
+            return compare_keys(arena.slot(a.slot), arena.slot(b.slot), block_prefix_size) < 0;
+        });
+
+    for(size_t i = 0; i < entries.size(); ++i)
+        order[i] = entries[i].slot;
+}
+
+seastar::future<> sort_blocks_async(block_arena &arena, sort_mode mode)
+{
+    return seastar::async([&arena, mode]{
+        sort_blocks(arena, mode);
+    });
+}
+
+}
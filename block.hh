@@ -28,22 +28,151 @@
 
 #include <seastar/core/memory.hh>
 #include <iterator>
+#include "block_compare.hh"
+#include "key_spec.hh"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 extern int const block_size;
 
 namespace datablock{
 
+// Size of the records sorted, block_size by default. Any file is a sequence of records, while block_size
+// stays the unit of the disk I/O: records smaller than a block are packed many per block.
+extern size_t record_size;
+
+// compare kernel of the whole record, specialized for the record size when a fixed width kernel exists
+extern compare_fixed_fn record_compare;
+
+// set the record size, a power of two from 8 to block_size, and select its compare kernel.
+// Throws std::invalid_argument for any other size. It has to be set before the key spec and before sorting.
+void set_record_size(size_t size);
+
+// name of the kernel comparing whole records
+const char* record_compare_name();
+
 using blocks_data = unsigned char[];
 using blocks_ptr = std::unique_ptr<blocks_data,seastar::free_deleter>;
 using blocks_vector = std::vector<std::unique_ptr<unsigned char[],seastar::free_deleter>>;
 
 void sort_blocks(blocks_vector &blocks);
 
+// three-way compare of the keys of two records starting from the byte from of the normalized keys, see key_spec.hh
+inline int compare_keys(const unsigned char* a, const unsigned char* b, size_t from) {
+    if(whole_block_key){
+        if(from == 0)
+            return record_compare(a, b);
+        return compare_bytes(a + from, b + from, record_size - from);
+    }
+    return active_key_spec().compare(a, b, from);
+}
+
+// three-way compare of two blocks by their keys, see block_compare.hh and key_spec.hh
+inline int compare_blocks(const unsigned char* a, const unsigned char* b) {
+    return compare_keys(a, b, 0);
+}
+
+// Arena of records that reserves the memory of a whole partition by a single aligned allocation.
+// Any record is copied in a slot of record_size bytes of the arena and the partition order is kept as a vector of slot indices,
+// so sorting moves indices instead of blocks. reset() empties the arena keeping its memory for the next partition.
+class block_arena
+{
+public:
+    explicit block_arena(size_t capacity):
+        _data(seastar::allocate_aligned_buffer<unsigned char>(std::max<size_t>(capacity, 1) * record_size, block_size)),
+        _capacity(std::max<size_t>(capacity, 1)){
+        _order.reserve(_capacity);
+    }
+
+    size_t capacity() const { return _capacity; }
+    size_t size() const { return _order.size(); }
+    bool empty() const { return _order.empty(); }
+    bool full() const { return _order.size() == _capacity; }
+
+    // copy a block in the next free slot and append it to the order
+    uint32_t push_back(const unsigned char* block) {
+        const uint32_t slot_index = static_cast<uint32_t>(_order.size());
+        std::copy(block, block + record_size, slot(slot_index));
+        _order.push_back(slot_index);
+        return slot_index;
+    }
+
+    unsigned char* slot(uint32_t slot_index) {
+        return _data.get() + static_cast<size_t>(slot_index) * record_size;
+    }
+
+    const unsigned char* slot(uint32_t slot_index) const {
+        return _data.get() + static_cast<size_t>(slot_index) * record_size;
+    }
+
+    // i-th block of the partition order
+    const unsigned char* block(size_t i) const {
+        return slot(_order[i]);
+    }
+
+    std::vector<uint32_t>& order() { return _order; }
+    const std::vector<uint32_t>& order() const { return _order; }
+
+    void reset() {
+        _order.clear();
+    }
+
+private:
+    blocks_ptr _data;
+    size_t _capacity;
+    std::vector<uint32_t> _order;
+};
+
+// algorithm used to sort the partition in memory
+enum class sort_mode {
+    // std::stable_sort of slot indices comparing the keys of the blocks
+    stable,
+    // std::stable_sort of a compact array of (key prefix, slot index), keys are compared only on prefix ties
+    prefix,
+    // MSD radix sort on the bytes of the normalized keys, small buckets are sorted by compare
+    radix
+};
+
+// first 8 bytes of the normalized key of the block loaded as big-endian integer:
+// the integer order of two prefixes is the lexicographic order of their bytes.
+inline uint64_t block_prefix(const unsigned char* block) {
+    if(!whole_block_key)
+        return active_key_spec().prefix(block);
+    uint64_t prefix;
+    std::memcpy(&prefix, block, sizeof(prefix));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+const size_t block_prefix_size(sizeof(uint64_t));
+
+// min average length of the natural runs of a partition that are merged instead of sorting the partition
+const size_t natural_run_min_size(16);
+
+// compares between two checks of the preemption of a sort running in a seastar thread
+const unsigned preemption_check_interval(64);
+
+// sort the order of the arena blocks.
+// A partition made of long ascending or descending runs is sorted by merging its runs, whatever the mode.
+// Called from a seastar thread the sort yields whenever the reactor needs the cpu.
+void sort_blocks(block_arena &arena, sort_mode mode = sort_mode::prefix);
+
+// compares made by the sorts of this shard
+uint64_t sort_compares();
+
+// sort the order of the arena blocks in a seastar thread, so a large partition doesn't stall the reactor.
+// the arena must be kept alive and untouched until the returned future is resolved.
+seastar::future<> sort_blocks_async(block_arena &arena, sort_mode mode = sort_mode::prefix);
+
 template<class InputIt>
 blocks_ptr make_block(InputIt start_sequence, InputIt end_sequence){
-    blocks_ptr tmp(std::move(seastar::allocate_aligned_buffer<unsigned char>(block_size, block_size)));
+    blocks_ptr tmp(std::move(seastar::allocate_aligned_buffer<unsigned char>(record_size, block_size)));
     auto *ptr = tmp.get();
-    std::copy(start_sequence, std::min(end_sequence, start_sequence+block_size) , ptr);
+    auto end = std::copy(start_sequence, std::min(end_sequence, start_sequence+record_size) , ptr);
+    std::fill(end, ptr + record_size, 0);
     return tmp; //implicit move
 }
 
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block_compare.hh"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BIGSORT_X86_KERNELS
+#endif
+
+namespace datablock {
+
+static inline int compare_byte(unsigned char a, unsigned char b)
+{
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+// compare 8 bytes at time, on mismatch the words loaded as big-endian give the order
+int compare_bytes_scalar(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+        uint64_t x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        if(x != y){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            x = __builtin_bswap64(x);
+            y = __builtin_bswap64(y);
+#endif
+            return x < y ? -1 : 1;
+        }
+    }
+    for(; i < len; ++i){
+        if(a[i] != b[i])
+            return compare_byte(a[i], b[i]);
+    }
+    return 0;
+}
+
+#ifdef BIGSORT_X86_KERNELS
+
+__attribute__((target("sse2")))
+static int compare_bytes_sse2(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16){
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const unsigned equal = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+        if(equal != 0xffff){
+            const size_t d = i + __builtin_ctz(~equal);
+            return compare_byte(a[d], b[d]);
+        }
+    }
+    return compare_bytes_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int compare_bytes_avx2(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32){
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const unsigned equal = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if(equal != 0xffffffffu){
+            const size_t d = i + __builtin_ctz(~equal);
+            return compare_byte(a[d], b[d]);
+        }
+    }
+    return compare_bytes_sse2(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int compare_bytes_avx512(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    size_t i = 0;
+    for(; i + 64 <= len; i += 64){
+        const __m512i x = _mm512_loadu_si512(a + i);
+        const __m512i y = _mm512_loadu_si512(b + i);
+        const __mmask64 different = _mm512_cmpneq_epu8_mask(x, y);
+        if(different){
+            const size_t d = i + __builtin_ctzll(different);
+            return compare_byte(a[d], b[d]);
+        }
+    }
+    return compare_bytes_avx2(a + i, b + i, len - i);
+}
+
+#endif
+
+const std::vector<compare_kernel>& compare_kernels()
+{
+    static const std::vector<compare_kernel> kernels = []{
+        std::vector<compare_kernel> k;
+        k.push_back(compare_kernel{"scalar", compare_bytes_scalar, true});
+#ifdef BIGSORT_X86_KERNELS
+        __builtin_cpu_init();
+        k.push_back(compare_kernel{"sse2", compare_bytes_sse2, __builtin_cpu_supports("sse2") != 0});
+        k.push_back(compare_kernel{"avx2", compare_bytes_avx2, __builtin_cpu_supports("avx2") != 0});
+        k.push_back(compare_kernel{"avx512", compare_bytes_avx512,
+                                   __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")});
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+const compare_kernel& active_compare_kernel()
+{
+    static const compare_kernel& active = []() -> const compare_kernel& {
+        const auto& kernels = compare_kernels();
+        size_t best = 0;
+        for(size_t i = 0; i < kernels.size(); ++i){
+            if(kernels[i].supported)
+                best = i;
+        }
+        return kernels[best];
+    }();
+    return active;
+}
+
+// Fixed width kernels, N is a multiple of the vector width so the loops have a constant trip count.
+template <size_t N>
+static int compare_fixed_scalar(const unsigned char* a, const unsigned char* b)
+{
+    for(size_t i = 0; i < N; i += sizeof(uint64_t)){
+        uint64_t x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        if(x != y){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            x = __builtin_bswap64(x);
+            y = __builtin_bswap64(y);
+#endif
+            return x < y ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef BIGSORT_X86_KERNELS
+
+template <size_t N>
+__attribute__((target("avx2")))
+static int compare_fixed_avx2(const unsigned char* a, const unsigned char* b)
+{
+    for(size_t i = 0; i < N; i += 32){
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const unsigned equal = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if(equal != 0xffffffffu){
+            const size_t d = i + __builtin_ctz(~equal);
+            return compare_byte(a[d], b[d]);
+        }
+    }
+    return 0;
+}
+
+template <size_t N>
+__attribute__((target("avx512f,avx512bw")))
+static int compare_fixed_avx512(const unsigned char* a, const unsigned char* b)
+{
+    for(size_t i = 0; i < N; i += 64){
+        const __m512i x = _mm512_loadu_si512(a + i);
+        const __m512i y = _mm512_loadu_si512(b + i);
+        const __mmask64 different = _mm512_cmpneq_epu8_mask(x, y);
+        if(different){
+            const size_t d = i + __builtin_ctzll(different);
+            return compare_byte(a[d], b[d]);
+        }
+    }
+    return 0;
+}
+
+#endif
+
+template <size_t N>
+static void add_fixed_kernels(std::vector<fixed_compare_kernel>& k)
+{
+    k.push_back(fixed_compare_kernel{"scalar", N, compare_fixed_scalar<N>, true});
+#ifdef BIGSORT_X86_KERNELS
+    k.push_back(fixed_compare_kernel{"avx2", N, compare_fixed_avx2<N>, __builtin_cpu_supports("avx2") != 0});
+    k.push_back(fixed_compare_kernel{"avx512", N, compare_fixed_avx512<N>,
+                                     __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")});
+#endif
+}
+
+const std::vector<fixed_compare_kernel>& fixed_compare_kernels()
+{
+    static const std::vector<fixed_compare_kernel> kernels = []{
+        std::vector<fixed_compare_kernel> k;
+#ifdef BIGSORT_X86_KERNELS
+        __builtin_cpu_init();
+#endif
+        add_fixed_kernels<64>(k);
+        add_fixed_kernels<128>(k);
+        add_fixed_kernels<512>(k);
+        add_fixed_kernels<4096>(k);
+        return k;
+    }();
+    return kernels;
+}
+
+const fixed_compare_kernel* find_fixed_compare_kernel(size_t width)
+{
+    const fixed_compare_kernel* best = nullptr;
+    for(auto& kernel:fixed_compare_kernels()){
+        if(kernel.width == width && kernel.supported)
+            best = &kernel;
+    }
+    return best;
+}
+
+// selected before main, the hot path is a single indirect call
+static const compare_fn active_compare = active_compare_kernel().compare;
+
+int compare_bytes(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    return active_compare(a, b, len);
+}
+
+}
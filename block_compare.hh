@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace datablock {
+
+// Three-way compare of len bytes as unsigned char, the result has the sign of memcmp.
+using compare_fn = int (*)(const unsigned char* a, const unsigned char* b, size_t len);
+
+struct compare_kernel
+{
+    const char* name;
+    compare_fn compare;
+    // the cpu supports the instructions used by the kernel
+    bool supported;
+};
+
+// all the kernels built in, the scalar one first
+const std::vector<compare_kernel>& compare_kernels();
+
+// the fastest supported kernel, chosen once at startup by cpuid
+const compare_kernel& active_compare_kernel();
+
+// reference implementation
+int compare_bytes_scalar(const unsigned char* a, const unsigned char* b, size_t len);
+
+// compare by the active kernel, used by any sort and merge path
+int compare_bytes(const unsigned char* a, const unsigned char* b, size_t len);
+
+// Three-way compare of a fixed number of bytes known at compile time, so the loop is unrolled.
+using compare_fixed_fn = int (*)(const unsigned char* a, const unsigned char* b);
+
+struct fixed_compare_kernel
+{
+    const char* name;
+    size_t width;
+    compare_fixed_fn compare;
+    bool supported;
+};
+
+// all the fixed width kernels built in, any width has a scalar kernel first
+const std::vector<fixed_compare_kernel>& fixed_compare_kernels();
+
+// the fastest supported kernel of width bytes, nullptr if no kernel is specialized for width
+const fixed_compare_kernel* find_fixed_compare_kernel(size_t width);
+
+}
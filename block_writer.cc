@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block_writer.hh"
+#include "sort_metrics.hh"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace file_utils {
+
+block_writer::block_writer(seastar::file f, uint64_t offset, writer_options opts):
+    _file(std::move(f)),
+    _pos(offset),
+    _since_flush(0),
+    _opts(opts),
+    _used(0),
+    _state(seastar::make_lw_shared<write_state>(opts.max_writes)){}
+
+seastar::future<> block_writer::write(const unsigned char* data, size_t len)
+{
+    if(_state->error)
+        return seastar::make_exception_future<>(_state->error);
+
+    while(len){
+        if(!_current){
+            if(_state->free_buffers.empty()){
+                _current = seastar::allocate_aligned_buffer<unsigned char>(_opts.buffer_size, block_size);
+            }else{
+                _current = std::move(_state->free_buffers.back());
+                _state->free_buffers.pop_back();
+            }
+        }
+
+        const size_t n = std::min(len, _opts.buffer_size - _used);
+        std::memcpy(_current.get() + _used, data, n);
+        _used += n;
+        data += n;
+        len -= n;
+
+        if(_used == _opts.buffer_size){
+            return submit().then([this, data, len]{
+                return len ? write(data, len) : seastar::make_ready_future<>();
+            });
+        }
+    }
+    return seastar::make_ready_future<>();
+}
+
+// start the write of the current buffer in background.
+// the returned future is resolved as soon as the write is in flight.
+seastar::future<> block_writer::submit()
+{
+    const size_t len = _used;
+    const uint64_t pos = _pos;
+    _pos += len;
+    _used = 0;
+    return _state->in_flight.wait(1).then([this, buffer=std::move(_current), len, pos]() mutable {
+        auto wb = buffer.get();
+        // the write completes in background, it holds the file and the state it updates
+        sort_metrics::track_write(_file.dma_write(pos, wb, len)).then_wrapped([state=_state, f=_file, buffer=std::move(buffer), len](auto w) mutable {
+            try {
+                if(w.get0() < len)
+                    throw std::runtime_error("short write on output file");
+                state->written += len;
+            } catch(...) {
+                state->error = std::current_exception();
+            }
+            state->free_buffers.push_back(std::move(buffer));
+            state->in_flight.signal(1);
+        });
+
+        _since_flush += len;
+        if(!_opts.flush_interval || _since_flush < _opts.flush_interval)
+            return seastar::make_ready_future<>();
+
+        // wait all the writes in flight before flush
+        _since_flush = 0;
+        return _state->in_flight.wait(_opts.max_writes).then([this]{
+            return _file.flush();
+        }).finally([this]{
+            _state->in_flight.signal(_opts.max_writes);
+        });
+    });
+}
+
+seastar::future<> block_writer::close()
+{
+    // records smaller than a block can leave a partial block at the end
+    const uint64_t end = _pos + _used;
+    const size_t padding = (block_size - _used % block_size) % block_size;
+    if(padding){
+        std::fill(_current.get() + _used, _current.get() + _used + padding, 0);
+        _used += padding;
+    }
+
+    auto pending = _used ? submit() : seastar::make_ready_future<>();
+    return pending.then([this]{
+        return _state->in_flight.wait(_opts.max_writes);
+    }).then([this, end, padding]{
+        _state->in_flight.signal(_opts.max_writes);
+        if(_state->error)
+            return seastar::make_exception_future<>(_state->error);
+        if(!padding)
+            return _file.flush();
+        _state->written -= padding;
+        return _file.truncate(end).then([this]{
+            return _file.flush();
+        });
+    }).finally([this]{
+        return _file.close();
+    });
+}
+
+stream_writer::stream_writer(seastar::pollable_fd& out, size_t buffer_size):
+    _out(out),
+    _buffer_size(std::max<size_t>(buffer_size, 1)),
+    _pending(seastar::make_ready_future<>()),
+    _state(seastar::make_lw_shared<write_state>()){
+    _current.reserve(_buffer_size);
+}
+
+seastar::future<> stream_writer::write(const unsigned char* data, size_t len)
+{
+    if(_state->error)
+        return seastar::make_exception_future<>(_state->error);
+
+    while(len){
+        const size_t n = std::min(len, _buffer_size - _current.size());
+        _current.insert(_current.end(), data, data + n);
+        data += n;
+        len -= n;
+
+        if(_current.size() == _buffer_size){
+            return submit().then([this, data, len]{
+                return len ? write(data, len) : seastar::make_ready_future<>();
+            });
+        }
+    }
+    return seastar::make_ready_future<>();
+}
+
+// wait the write in flight, then start the write of the current buffer in background
+seastar::future<> stream_writer::submit()
+{
+    auto previous = std::exchange(_pending, seastar::make_ready_future<>());
+    return previous.then([this]{
+        if(_state->error)
+            return seastar::make_exception_future<>(_state->error);
+        std::swap(_current, _state->in_flight);
+        _current.clear();
+        const size_t len = _state->in_flight.size();
+        // the write completes in background, it holds the state and the buffer it writes from
+        _pending = sort_metrics::track_write(_out.write_all(_state->in_flight.data(), len).then([len]{
+            return len;
+        })).then_wrapped([state=_state](auto f) {
+            try {
+                state->written += f.get0();
+            } catch(...) {
+                state->error = std::current_exception();
+            }
+        });
+        return seastar::make_ready_future<>();
+    });
+}
+
+seastar::future<> stream_writer::close()
+{
+    auto pending = _current.empty() ? seastar::make_ready_future<>() : submit();
+    // the write in flight is waited even when the last buffer can't be written, its error is in the state
+    return pending.then_wrapped([this](auto f){
+        f.ignore_ready_future();
+        return std::exchange(_pending, seastar::make_ready_future<>());
+    }).then([state=_state]{
+        if(state->error)
+            return seastar::make_exception_future<>(state->error);
+        return seastar::make_ready_future<>();
+    });
+}
+
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <seastar/core/file.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/core/future.hh>
+#include <seastar/core/reactor.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <exception>
+#include <vector>
+#include "block.hh"
+
+namespace file_utils {
+
+struct writer_options
+{
+    // size of any write, must be a multiple of block_size
+    size_t buffer_size = 4*1024*1024;
+    // max number of writes in flight
+    size_t max_writes = 4;
+    // flush the file every flush_interval bytes, 0 means flush only at close
+    uint64_t flush_interval = 0;
+};
+
+// Write-behind writer of blocks sequence.
+// Blocks are copied in a large aligned buffer that is written in background when full,
+// up to max_writes buffers can be in flight so the caller can prepare the next blocks while the disk works.
+// The caller waits only when all buffers are in flight.
+// The writes in flight hold the state they update, so a writer destroyed without close() on an error path
+// leaves them to complete safely, close() is still needed to write the pending buffer and to wait the writes.
+class block_writer
+{
+public:
+    block_writer(seastar::file f, uint64_t offset = 0, writer_options opts = writer_options());
+    block_writer(const block_writer&) = delete;
+
+    // copy len bytes to the output.
+    // data must be valid until the returned future is resolved.
+    seastar::future<> write(const unsigned char* data, size_t len);
+
+    // write the pending buffer, wait all the writes, flush and close the file.
+    // A pending buffer that is not a multiple of block_size is padded by zeros to be written
+    // and the file is truncated to the bytes written, so the writer has to be the last one of the file.
+    seastar::future<> close();
+
+    uint64_t bytes_written() const {
+        return _state->written;
+    }
+
+private:
+    // state updated by the writes in flight
+    struct write_state
+    {
+        explicit write_state(size_t max_writes):written(0), in_flight(max_writes){}
+
+        uint64_t written;
+        std::vector<datablock::blocks_ptr> free_buffers;
+        seastar::semaphore in_flight;
+        std::exception_ptr error;
+    };
+
+    seastar::future<> submit();
+
+    seastar::file _file;
+    uint64_t _pos;
+    uint64_t _since_flush;
+    writer_options _opts;
+    datablock::blocks_ptr _current;
+    size_t _used;
+    seastar::lw_shared_ptr<write_state> _state;
+};
+
+// Write-behind writer of a stream, a pipe or a socket whose length is unknown and that can't be written at offsets.
+// Blocks are copied in a buffer that is written in background when full while the next one is filled,
+// the writes are made one at a time so the stream gets the blocks in order. The stream is owned by the caller.
+// As for block_writer the write in flight holds the buffer and the state it updates, close() waits it on the error path too.
+class stream_writer
+{
+public:
+    explicit stream_writer(seastar::pollable_fd& out, size_t buffer_size = writer_options().buffer_size);
+    stream_writer(const stream_writer&) = delete;
+
+    // copy len bytes to the output.
+    // data must be valid until the returned future is resolved.
+    seastar::future<> write(const unsigned char* data, size_t len);
+
+    // write the pending buffer and wait all the writes, the stream is left open
+    seastar::future<> close();
+
+    uint64_t bytes_written() const {
+        return _state->written;
+    }
+
+private:
+    // state updated by the write in flight
+    struct write_state
+    {
+        write_state():written(0){}
+
+        uint64_t written;
+        std::vector<unsigned char> in_flight;
+        std::exception_ptr error;
+    };
+
+    seastar::future<> submit();
+
+    seastar::pollable_fd& _out;
+    size_t _buffer_size;
+    std::vector<unsigned char> _current;
+    seastar::future<> _pending;
+    seastar::lw_shared_ptr<write_state> _state;
+};
+
+}
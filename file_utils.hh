@@ -19,82 +19,225 @@
  * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
 #include <seastar/core/reactor.hh>
 #include <seastar/core/file.hh>
+#include <seastar/core/temporary_buffer.hh>
 #include <boost/iterator/counting_iterator.hpp>
 #include "block.hh"
+#include "block_writer.hh"
+#include "front_coding.hh"
+#include "sort_metrics.hh"
 #include <memory>
+#include <cstring>
+#include <deque>
 
 namespace file_utils {
 
 using namespace datablock;
 
+struct reader_options
+{
+    // size of any read, must be a multiple of block_size
+    size_t extent_size = 4*1024*1024;
+    // max number of reads in flight
+    size_t queue_depth = 4;
+};
+
+const uint64_t end_of_file(static_cast<uint64_t>(-1));
+
+// Read the blocks [first_block, last_block) of the file by large extents keeping up to queue_depth reads in flight,
+// here and below a block is a record of record_size bytes, extents are handed to the action in file order
+// as a view of consecutive blocks:
+// action(const unsigned char* blocks, uint64_t count, uint64_t first_block_index, uint64_t blocks_tot)
+// first_block_index is relative to first_block and blocks_tot is the number of blocks of the range.
+// blocks are valid until the future returned by the action is resolved.
+// A trailing partial block is handed as a whole block padded by zeros.
+// The file is opened and closed by the caller, so several ranges are read by a single open.
 template <typename Action>
-seastar::future<> read_blocks_from_file(seastar::sstring fname, Action action) {
-    return seastar::open_file_dma(fname, seastar::open_flags::rw)
-    .then([action=std::move(action)](seastar::file f) mutable {
-        return f.size().then([action=std::move(action), f](size_t size) mutable {
-            int count = size / block_size;
-            return seastar::do_for_each(
-                    boost::counting_iterator<uint32_t>(0),
-                    boost::counting_iterator<uint32_t>(count),
-                    [f, action=std::move(action), count](auto &i) mutable {
-
-                auto rbuf = seastar::allocate_aligned_buffer<unsigned char>(block_size, block_size);
-                size_t pos = static_cast<size_t>(i) * static_cast<size_t>(block_size);
-                auto rb = rbuf.get();
-                return f.dma_read(pos, rb, block_size)
-                .then([i, count, rbuf = std::move(rbuf), pos, action=std::move(action),f](size_t ret) mutable {
-                    return seastar::futurize_apply(std::move(action),
-                                                    std::move(rbuf),
-                                                    std::move(i),
-                                                    std::move(count))
-                    .finally([f](){});
+seastar::future<> read_extents_from_file(seastar::file f, Action action, reader_options opts = reader_options(),
+                                         uint64_t first_block = 0, uint64_t last_block = end_of_file) {
+    return f.size().then([action=std::move(action), opts, f, first_block, last_block](uint64_t size) mutable {
+        const uint64_t file_blocks = size / record_size + (size % record_size == 0 ? 0 : 1);
+        const uint64_t range_end = std::min(last_block, file_blocks);
+        const uint64_t blocks_tot = range_end > first_block ? range_end - first_block : 0;
+        const uint64_t extent_blocks = std::max<uint64_t>(1, opts.extent_size / record_size);
+        const uint64_t extents = (blocks_tot + extent_blocks - 1) / extent_blocks;
+        using extent_future = seastar::future<seastar::temporary_buffer<unsigned char>>;
+
+        return seastar::do_with(std::move(action), std::deque<extent_future>(), uint64_t(0),
+                                [f, opts, first_block, blocks_tot, extent_blocks, extents](auto& action, auto& in_flight, auto& issued) mutable {
+            // keep the queue full
+            auto issue = [f, opts, first_block, blocks_tot, extent_blocks, extents, &in_flight, &issued]() mutable {
+                while(issued < extents && in_flight.size() < opts.queue_depth){
+                    const uint64_t first = issued * extent_blocks;
+                    const uint64_t count = std::min(extent_blocks, blocks_tot - first);
+                    in_flight.push_back(sort_metrics::track_read(f.dma_read<unsigned char>((first_block + first) * record_size, count * record_size)));
+                    ++issued;
+                }
+            };
+            issue();
+
+            return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                        boost::counting_iterator<uint64_t>(extents),
+                                        [&action, &in_flight, issue, blocks_tot, extent_blocks](uint64_t i) mutable {
+                auto extent = std::move(in_flight.front());
+                in_flight.pop_front();
+                return extent.then([&action, issue, i, blocks_tot, extent_blocks](seastar::temporary_buffer<unsigned char> buf) mutable {
+                    issue();
+                    const uint64_t first = i * extent_blocks;
+                    const uint64_t count = std::min(extent_blocks, blocks_tot - first);
+                    if(buf.size() < count * record_size){
+                        // last extent, pad the partial block by zeros
+                        auto padded = seastar::temporary_buffer<unsigned char>::aligned(block_size, count * record_size);
+                        std::copy(buf.get(), buf.get() + buf.size(), padded.get_write());
+                        std::fill(padded.get_write() + buf.size(), padded.get_write() + count * record_size, 0);
+                        buf = std::move(padded);
+                    }
+                    auto data = buf.get();
+                    return seastar::futurize_apply(action, std::move(data), std::move(count), std::move(first), std::move(blocks_tot))
+                    .finally([buf=std::move(buf)]{});
                 });
             });
         });
     });
 }
 
-seastar::future<> write_blocks(blocks_vector& blocks, seastar::sstring fname) {
+// Same as above, the file is opened and closed by the read.
+template <typename Action>
+seastar::future<> read_extents_from_file(seastar::sstring fname, Action action, reader_options opts = reader_options(),
+                                         uint64_t first_block = 0, uint64_t last_block = end_of_file) {
+    return seastar::open_file_dma(fname, seastar::open_flags::ro)
+    .then([action=std::move(action), opts, first_block, last_block](seastar::file f) mutable {
+        return read_extents_from_file(f, std::move(action), opts, first_block, last_block).finally([f]() mutable {
+            return f.close().finally([f]{});
+        });
+    });
+}
+
+// Read the file block by block, any block is handed to the action as a blocks_ptr:
+// action(blocks_ptr&& block, uint64_t block_index, uint64_t blocks_tot)
+template <typename Action>
+seastar::future<> read_blocks_from_file(seastar::sstring fname, Action action, reader_options opts = reader_options()) {
+    return read_extents_from_file(fname, [action=std::move(action)](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot) mutable {
+        return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                    boost::counting_iterator<uint64_t>(count),
+                                    [&action, data, first, blocks_tot](uint64_t i) mutable {
+            auto block = data + i * record_size;
+            return seastar::futurize_apply(action, make_block(block, block + record_size), first + i, blocks_tot);
+        });
+    }, opts);
+}
+
+inline seastar::future<> write_blocks(blocks_vector& blocks, seastar::sstring fname, writer_options opts = writer_options()) {
     return seastar::open_file_dma(fname,seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
-    .then([&blocks](seastar::file f) mutable {
-        return seastar::do_with(seastar::semaphore(10), [f, &blocks](auto &semaphore) mutable {
-            return seastar::do_for_each(boost::counting_iterator<uint32_t>(0),
-                                        boost::counting_iterator<uint32_t>(blocks.size()),
-                                        [f, &blocks, &semaphore](auto& i) mutable {
-                return semaphore.wait(1).then([f, &blocks, i, &semaphore]() mutable {
-                    auto wb = blocks[i].get();
-                    f.dma_write(i * block_size, wb, block_size).then([f, &semaphore](auto ret){
-                        // check size
-                    }).finally([&semaphore] { semaphore.signal(1); });
-                });
-            }).then([f, &semaphore]() mutable {
-                return semaphore.wait(10).then([f]() mutable{
-                    return f.flush().then([f]()mutable{
-                        return f.close().finally([f] {});
-                    });
-                });
+    .then([&blocks, opts](seastar::file f) mutable {
+        return seastar::do_with(std::make_unique<block_writer>(std::move(f), 0, opts), [&blocks](auto &writer) {
+            return seastar::do_for_each(blocks, [&writer](auto& block) {
+                return writer->write(block.get(), record_size);
+            }).then([&writer]{
+                return writer->close();
+            });
+        });
+    });
+}
+
+// write the blocks of the arena in their order by the write-behind writer
+inline seastar::future<> write_blocks(const block_arena& arena, seastar::sstring fname, writer_options opts = writer_options()) {
+    return seastar::open_file_dma(fname,seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([&arena, opts](seastar::file f) mutable {
+        return seastar::do_with(std::make_unique<block_writer>(std::move(f), 0, opts), [&arena](auto &writer) {
+            return seastar::do_for_each(boost::counting_iterator<size_t>(0),
+                                        boost::counting_iterator<size_t>(arena.size()),
+                                        [&arena, &writer](size_t i) {
+                return writer->write(arena.block(i), record_size);
+            }).then([&writer]{
+                return writer->close();
+            });
+        });
+    });
+}
+
+// write the blocks of the arena in their order to the stream out, a pipe or a socket
+inline seastar::future<> write_blocks(const block_arena& arena, seastar::pollable_fd& out, writer_options opts = writer_options()) {
+    return seastar::do_with(std::make_unique<stream_writer>(out, opts.buffer_size), [&arena](auto &writer) {
+        return seastar::do_for_each(boost::counting_iterator<size_t>(0),
+                                    boost::counting_iterator<size_t>(arena.size()),
+                                    [&arena, &writer](size_t i) {
+            return writer->write(arena.block(i), record_size);
+        }).then_wrapped([&writer](auto written){
+            // the write in flight is waited on the error path too
+            return writer->close().then_wrapped([written=std::move(written)](auto closed) mutable {
+                if(written.failed()){
+                    closed.ignore_ready_future();
+                    return std::move(written);
+                }
+                return std::move(closed);
+            });
+        });
+    });
+}
+
+// write the blocks of the arena in their order as front coded pages, see front_coding.hh
+inline seastar::future<> write_front_coded(const block_arena& arena, const std::vector<coded_entry>& entries,
+                                           seastar::sstring fname, writer_options opts = writer_options()) {
+    return seastar::open_file_dma(fname,seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([&arena, &entries, opts](seastar::file f) mutable {
+        auto page = seastar::allocate_aligned_buffer<unsigned char>(spill_page_size, block_size);
+        return seastar::do_with(std::make_unique<block_writer>(std::move(f), 0, opts), std::move(page), size_t(0),
+                                [&arena, &entries](auto &writer, auto& page, auto& encoded) {
+            return seastar::do_until([&arena, &encoded]{ return encoded == arena.size(); }, [&arena, &entries, &writer, &page, &encoded]{
+                encoded += encode_page(arena, entries, encoded, page.get());
+                return writer->write(page.get(), spill_page_size);
+            }).then([&writer]{
+                return writer->close();
+            });
+        });
+    });
+}
+
+// A key record holds the first key_record_key_size bytes of the normalized key of a block followed by
+// the index of the block in the file to be sorted as uint64_t in host byte order.
+const size_t key_record_key_size(56);
+const size_t key_record_size(64);
+
+// write the key records of the arena blocks in their order, the block in slot i is the block source_first + i of the file.
+// the last block of the file is padded by zeros.
+inline seastar::future<> write_key_records(const block_arena& arena, uint64_t source_first,
+                                           seastar::sstring fname, writer_options opts = writer_options()) {
+    const size_t len = arena.size() * key_record_size;
+    auto records = seastar::allocate_aligned_buffer<unsigned char>(std::max<size_t>(len, block_size), block_size);
+    for(size_t i = 0; i < arena.size(); ++i){
+        unsigned char* record = records.get() + i * key_record_size;
+        const uint64_t source = source_first + arena.order()[i];
+        active_key_spec().normalize(arena.block(i), record, key_record_key_size);
+        std::memcpy(record + key_record_key_size, &source, sizeof(source));
+    }
+
+    return seastar::open_file_dma(fname,seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([records=std::move(records), len, opts](seastar::file f) mutable {
+        return seastar::do_with(std::make_unique<block_writer>(std::move(f), 0, opts), std::move(records), [len](auto &writer, auto& records) {
+            return writer->write(records.get(), len).then([&writer]{
+                return writer->close();
             });
         });
     });
 }
 
-seastar::future<> create_block_collections_from_file(blocks_vector& blocks, seastar::sstring fname, int blocks_offset, int count) {
+inline seastar::future<> create_block_collections_from_file(blocks_vector& blocks, seastar::sstring fname, int blocks_offset, int count) {
     return seastar::open_file_dma(fname,seastar::open_flags::rw)
     .then([count, &blocks, blocks_offset,fname](seastar::file f) mutable {
         return f.size().then([f, count, &blocks, blocks_offset,fname](size_t file_size) mutable {
-            count = count == -1 ? file_size/block_size : std::min(file_size/block_size, static_cast<size_t>(count));
+            count = count == -1 ? file_size/record_size : std::min(file_size/record_size, static_cast<size_t>(count));
             return seastar::do_for_each(
                     boost::counting_iterator<uint32_t>(blocks_offset),
                     boost::counting_iterator<uint32_t>(count),
                     [f, &blocks, &count, &blocks_offset](auto &i) mutable {
-                    auto rbuf = seastar::allocate_aligned_buffer<unsigned char>(block_size, block_size);
-                    int pos = i*block_size + blocks_offset * block_size;
-                    auto rb = rbuf.get();
-                    return f.dma_read(pos, rb, block_size)
-                    .then([rbuf = std::move(rbuf), &blocks, pos](size_t ret) mutable {
-                        blocks.push_back(std::move(rbuf));
+                    const uint64_t pos = (static_cast<uint64_t>(i) + blocks_offset) * record_size;
+                    return sort_metrics::track_read(f.dma_read<unsigned char>(pos, record_size))
+                    .then([&blocks](seastar::temporary_buffer<unsigned char> buf) mutable {
+                        blocks.push_back(make_block(buf.get(), buf.get() + buf.size()));
                         return seastar::make_ready_future<>();
                 });
             });
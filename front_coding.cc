@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "front_coding.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace datablock {
+
+// length of the block without its trailing zeros
+static size_t trimmed_size(const unsigned char* block)
+{
+    size_t len = record_size;
+    while(len && block[len - 1] == 0)
+        --len;
+    return len;
+}
+
+uint64_t front_code(const block_arena& arena, std::vector<coded_entry>& entries)
+{
+    entries.resize(arena.size());
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < arena.size(); ++i){
+        const unsigned char* block = arena.block(i);
+        const size_t len = trimmed_size(block);
+        size_t shared = 0;
+        if(i){
+            const unsigned char* prev = arena.block(i - 1);
+            shared = std::mismatch(block, block + len, prev).first - block;
+        }
+        entries[i] = coded_entry{static_cast<uint16_t>(shared), static_cast<uint16_t>(len - shared)};
+        bytes += sizeof(coded_entry) + len - shared;
+    }
+    return bytes;
+}
+
+size_t encode_page(const block_arena& arena, const std::vector<coded_entry>& entries, size_t first, unsigned char* page)
+{
+    unsigned char* pos = page + sizeof(page_header);
+    unsigned char* const end = page + spill_page_size;
+    size_t i = first;
+    for(; i < arena.size(); ++i){
+        coded_entry entry = entries[i];
+        if(i == first){
+            // the first block of the page is coded on its own
+            entry.suffix += entry.shared;
+            entry.shared = 0;
+        }
+        if(pos + sizeof(entry) + entry.suffix > end)
+            break;
+        std::memcpy(pos, &entry, sizeof(entry));
+        pos += sizeof(entry);
+        std::memcpy(pos, arena.block(i) + entry.shared, entry.suffix);
+        pos += entry.suffix;
+    }
+
+    const page_header header{static_cast<uint32_t>(i - first), static_cast<uint32_t>(pos - page)};
+    std::memcpy(page, &header, sizeof(header));
+    std::fill(pos, end, 0);
+    return i - first;
+}
+
+void page_decoder::reset(const unsigned char* page)
+{
+    page_header header;
+    std::memcpy(&header, page, sizeof(header));
+    _pos = page + sizeof(header);
+    _remaining = header.blocks;
+}
+
+void page_decoder::next(unsigned char* block)
+{
+    coded_entry entry;
+    std::memcpy(&entry, _pos, sizeof(entry));
+    _pos += sizeof(entry);
+    std::memcpy(block + entry.shared, _pos, entry.suffix);
+    std::fill(block + entry.shared + entry.suffix, block + record_size, 0);
+    _pos += entry.suffix;
+    --_remaining;
+}
+
+}
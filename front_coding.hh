@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "block.hh"
+
+namespace datablock {
+
+// format of the sorted files written by the internal sort
+enum class spill_format
+{
+    // 4K blocks as they are
+    raw,
+    // blocks front coded against their predecessor in pages of spill_page_size bytes
+    front_coded
+};
+
+// A front coded page starts with a page_header followed by the entries of its blocks.
+// Any entry is a coded_entry followed by suffix bytes: the block is the first shared bytes of the previous block,
+// then the suffix bytes, then zeros. The first block of a page is coded against nothing,
+// so any page can be decoded on its own. The page is padded by zeros to spill_page_size.
+const size_t spill_page_size(64*1024);
+
+struct page_header
+{
+    uint32_t blocks;
+    uint32_t bytes;
+};
+
+struct coded_entry
+{
+    uint16_t shared;
+    uint16_t suffix;
+};
+
+// Front code the blocks of the arena in their order, entries[i] codes the i-th block against the (i-1)-th one.
+// Returns the bytes of the coded blocks, page headers and padding excluded.
+uint64_t front_code(const block_arena& arena, std::vector<coded_entry>& entries);
+
+// Write to page the blocks of the arena starting at first, using the entries of front_code.
+// Returns the number of blocks written, the page is padded by zeros.
+size_t encode_page(const block_arena& arena, const std::vector<coded_entry>& entries, size_t first, unsigned char* page);
+
+// Decoder of a front coded page, any block is decoded in place over the previous one
+class page_decoder
+{
+public:
+    void reset(const unsigned char* page);
+
+    // blocks of the page not yet decoded
+    uint32_t remaining() const { return _remaining; }
+
+    // decode the next block of the page over block, that holds the previous block of the page
+    void next(unsigned char* block);
+
+private:
+    const unsigned char* _pos = nullptr;
+    uint32_t _remaining = 0;
+};
+
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "key_spec.hh"
+#include "block.hh"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace datablock {
+
+key_spec::key_spec(std::vector<key_field> fields):_fields(std::move(fields))
+{
+    for(auto& field:_fields){
+        // offset + length could wrap around
+        if(field.length == 0 || field.offset > record_size || field.length > record_size - field.offset)
+            throw std::invalid_argument("key field out of the record");
+        _size += field.length;
+    }
+}
+
+// a number of a key field, std::stoul takes a sign and blanks and wraps "-1" to the max
+static size_t parse_field_number(const std::string& number, const std::string& field)
+{
+    if(number.empty() || !std::all_of(number.begin(), number.end(), [](char c){ return c >= '0' && c <= '9'; }))
+        throw std::invalid_argument("key field offset and length must be decimal numbers, found " + field);
+    return std::stoul(number);
+}
+
+key_spec key_spec::parse(const std::string& spec)
+{
+    std::vector<key_field> fields;
+    if(spec.empty() || spec == "all")
+        return key_spec();
+
+    std::stringstream fields_stream(spec);
+    std::string field;
+    while(std::getline(fields_stream, field, ',')){
+        std::vector<std::string> parts;
+        std::stringstream field_stream(field);
+        std::string part;
+        while(std::getline(field_stream, part, ':'))
+            parts.push_back(part);
+        if(parts.size() < 2 || parts.size() > 3 || (parts.size() == 3 && parts[2] != "desc" && parts[2] != "asc"))
+            throw std::invalid_argument("key field must be offset:length[:asc|desc], found " + field);
+        fields.push_back(key_field{parse_field_number(parts[0], field), parse_field_number(parts[1], field), parts.size() == 3 && parts[2] == "desc"});
+    }
+    return key_spec(std::move(fields));
+}
+
+size_t key_spec::size() const
+{
+    return whole_block() ? record_size : _size;
+}
+
+void key_spec::normalize(const unsigned char* block, unsigned char* key, size_t len) const
+{
+    if(whole_block()){
+        const size_t n = std::min(len, record_size);
+        std::copy(block, block + n, key);
+        std::fill(key + n, key + len, 0);
+        return;
+    }
+
+    size_t pos = 0;
+    for(auto& field:_fields){
+        if(pos == len)
+            break;
+        const size_t n = std::min(field.length, len - pos);
+        const unsigned char* src = block + field.offset;
+        if(field.descending)
+            std::transform(src, src + n, key + pos, [](unsigned char c){ return static_cast<unsigned char>(~c); });
+        else
+            std::copy(src, src + n, key + pos);
+        pos += n;
+    }
+    std::fill(key + pos, key + len, 0);
+}
+
+int key_spec::compare(const unsigned char* a, const unsigned char* b, size_t from) const
+{
+    if(whole_block())
+        return from < record_size ? compare_bytes(a + from, b + from, record_size - from) : 0;
+
+    size_t pos = 0;
+    for(auto& field:_fields){
+        if(from >= pos + field.length){
+            pos += field.length;
+            continue;
+        }
+        const size_t skip = from > pos ? from - pos : 0;
+        const int cmp = compare_bytes(a + field.offset + skip, b + field.offset + skip, field.length - skip);
+        if(cmp != 0)
+            return field.descending ? -cmp : cmp;
+        pos += field.length;
+    }
+    return 0;
+}
+
+uint64_t key_spec::prefix(const unsigned char* block) const
+{
+    unsigned char bytes[sizeof(uint64_t)];
+    normalize(block, bytes, sizeof(bytes));
+    uint64_t prefix;
+    std::memcpy(&prefix, bytes, sizeof(prefix));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+static key_spec active_spec;
+bool whole_block_key = true;
+
+const key_spec& active_key_spec()
+{
+    return active_spec;
+}
+
+void set_key_spec(const key_spec& spec)
+{
+    active_spec = spec;
+    whole_block_key = spec.whole_block();
+}
+
+}
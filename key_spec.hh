@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace datablock {
+
+// bytes [offset, offset + length) of the block, compared in ascending or descending order
+struct key_field
+{
+    size_t offset;
+    size_t length;
+    bool descending;
+};
+
+// The key of a block is the concatenation of its fields, blocks are ordered by their keys.
+// The normalized key has the bytes of the descending fields inverted, so the order of two blocks
+// is the lexicographic order of their normalized keys. An empty spec is the whole block in ascending order.
+class key_spec
+{
+public:
+    key_spec() = default;
+
+    // throws std::invalid_argument if a field is empty or outside of the block
+    explicit key_spec(std::vector<key_field> fields);
+
+    // fields separated by commas as offset:length or offset:length:desc, e.g. "16:32,48:8:desc".
+    // "all" or an empty string is the whole block.
+    static key_spec parse(const std::string& spec);
+
+    bool whole_block() const { return _fields.empty(); }
+    const std::vector<key_field>& fields() const { return _fields; }
+
+    // length of the key
+    size_t size() const;
+
+    // write the first len bytes of the normalized key, padded by zeros if the key is shorter
+    void normalize(const unsigned char* block, unsigned char* key, size_t len) const;
+
+    // three-way compare of the normalized keys of two blocks starting from the byte from of the keys
+    int compare(const unsigned char* a, const unsigned char* b, size_t from = 0) const;
+
+    // first 8 bytes of the normalized key loaded as big-endian integer
+    uint64_t prefix(const unsigned char* block) const;
+
+private:
+    std::vector<key_field> _fields;
+    size_t _size = 0;
+};
+
+// key spec used by any sort and merge path, it has to be set before sorting
+const key_spec& active_key_spec();
+void set_key_spec(const key_spec& spec);
+
+// true while the active key spec is the whole block, that is compared by the fast paths
+extern bool whole_block_key;
+
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+namespace sort_algorithm {
+
+// Tournament tree of losers used by the k-way merge.
+// Leaves are the k sources (sorted runs), every internal node keeps the loser of the match
+// played between its two subtrees and the overall winner is kept apart.
+// When the head of the winning source changes only the matches on the path from its leaf
+// to the root are replayed, therefore any output element costs O(log k) compares.
+// An hexausted source is removed from the tournament: it loses any match without compare.
+//
+// Compare is a three-way compare between the heads of two sources: compare(a, b) < 0 when the head
+// of source a comes before the head of source b. Ties are won by the lower source index
+// to keep the merge stable.
+template <typename Compare>
+class loser_tree
+{
+public:
+    static const size_t none = static_cast<size_t>(-1);
+
+    loser_tree() : _k(0), _winner(none), _compares(0) {}
+
+    // Play the initial tournament. is_hexausted(i) tell if the source i is empty from the start.
+    template <typename IsHexausted>
+    void build(size_t k, Compare compare, IsHexausted is_hexausted) {
+        _k = k;
+        _compare = std::move(compare);
+        _compares = 0;
+        _hexausted.assign(k, false);
+        for(size_t i = 0; i < k; ++i)
+            _hexausted[i] = is_hexausted(i);
+
+        // winners[n] is the winner of the subtree rooted at node n, leaf i is the node k+i.
+        _losers.assign(k, none);
+        std::vector<size_t> winners(2 * k, none);
+        for(size_t i = 0; i < k; ++i)
+            winners[k + i] = i;
+        for(size_t n = k - 1; n >= 1 && n < k; --n){
+            size_t a = winners[2 * n];
+            size_t b = winners[2 * n + 1];
+            if(beats(a, b)){
+                winners[n] = a;
+                _losers[n] = b;
+            }else{
+                winners[n] = b;
+                _losers[n] = a;
+            }
+        }
+        _winner = k == 0 ? none : winners[1];
+    }
+
+    // true when all the sources are hexausted
+    bool empty() const {
+        return _winner == none || _hexausted[_winner];
+    }
+
+    // index of the source that hold the min head
+    size_t top() const {
+        return _winner;
+    }
+
+    // the head of the winner source has been replaced by its next element
+    void replay() {
+        size_t w = _winner;
+        for(size_t n = (w + _k) / 2; n >= 1; n /= 2){
+            if(beats(_losers[n], w))
+                std::swap(_losers[n], w);
+        }
+        _winner = w;
+    }
+
+    // the winner source has no more elements, remove it from the tournament
+    void remove() {
+        _hexausted[_winner] = true;
+        replay();
+    }
+
+    // number of compares between sources heads performed since build
+    uint64_t compares() const {
+        return _compares;
+    }
+
+private:
+    bool beats(size_t a, size_t b) {
+        if(a == none || _hexausted[a])
+            return false;
+        if(b == none || _hexausted[b])
+            return true;
+        ++_compares;
+        int cmp = _compare(a, b);
+        return cmp < 0 || (cmp == 0 && a < b);
+    }
+
+    size_t _k;
+    size_t _winner;
+    uint64_t _compares;
+    Compare _compare;
+    std::vector<size_t> _losers;
+    std::vector<bool> _hexausted;
+};
+
+template <typename Compare>
+const size_t loser_tree<Compare>::none;
+
+}
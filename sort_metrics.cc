@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sort_metrics.hh"
+#include "block.hh"
+#include <seastar/core/memory.hh>
+#include <seastar/core/smp.hh>
+#include <seastar/core/future-util.hh>
+#include <seastar/core/timer.hh>
+#include <boost/iterator/counting_iterator.hpp>
+#include <algorithm>
+#include <sstream>
+
+namespace sort_metrics {
+
+const char* phase_name(phase p)
+{
+    static const char* names[phases_count] = {"scan", "runs", "merge", "gather", "copy", "verify"};
+    return names[static_cast<size_t>(p)];
+}
+
+void latency_histogram::add(clock_type::duration d)
+{
+    const double us = std::chrono::duration<double, std::micro>(d).count();
+    size_t bucket = 0;
+    while(bucket + 1 < buckets && us > static_cast<double>(uint64_t(1) << bucket))
+        ++bucket;
+    ++_counts[bucket];
+    ++_count;
+    _sum_us += us;
+    _max_us = std::max(_max_us, us);
+}
+
+void latency_histogram::merge(const latency_histogram& other)
+{
+    for(size_t i = 0; i < buckets; ++i)
+        _counts[i] += other._counts[i];
+    _count += other._count;
+    _sum_us += other._sum_us;
+    _max_us = std::max(_max_us, other._max_us);
+}
+
+double latency_histogram::quantile_us(double q) const
+{
+    const double rank = q * _count;
+    uint64_t cumulated = 0;
+    for(size_t i = 0; i < buckets; ++i){
+        cumulated += _counts[i];
+        if(_counts[i] && cumulated >= rank)
+            return std::min(static_cast<double>(uint64_t(1) << i), _max_us);
+    }
+    return _max_us;
+}
+
+seastar::metrics::histogram latency_histogram::to_metrics() const
+{
+    seastar::metrics::histogram h;
+    h.sample_count = _count;
+    h.sample_sum = _sum_us;
+    uint64_t cumulated = 0;
+    for(size_t i = 0; i < buckets; ++i){
+        cumulated += _counts[i];
+        seastar::metrics::histogram_bucket bucket;
+        bucket.count = cumulated;
+        bucket.upper_bound = static_cast<double>(uint64_t(1) << i);
+        h.buckets.push_back(bucket);
+    }
+    return h;
+}
+
+static thread_local shard_stats stats;
+static thread_local seastar::metrics::metric_groups metrics;
+// samples the memory while the shard computes as well, not only when an I/O completes
+static thread_local seastar::timer<> memory_sampler;
+const std::chrono::milliseconds memory_sample_period(10);
+
+shard_stats& local_stats()
+{
+    return stats;
+}
+
+void set_phase(phase p)
+{
+    stats.current = p;
+}
+
+void sample_memory()
+{
+    stats.peak_memory = std::max(stats.peak_memory, seastar::memory::stats().allocated_memory());
+}
+
+void register_metrics()
+{
+    namespace sm = seastar::metrics;
+    std::vector<sm::metric_definition> defs;
+    for(size_t p = 0; p < phases_count; ++p){
+        const auto label = sm::label_instance("phase", phase_name(static_cast<phase>(p)));
+        defs.push_back(sm::make_derive("bytes_read", [p]{ return stats.phases[p].bytes_read; },
+                                       sm::description("Bytes read by the phase"), {label}));
+        defs.push_back(sm::make_derive("bytes_written", [p]{ return stats.phases[p].bytes_written; },
+                                       sm::description("Bytes written by the phase"), {label}));
+        defs.push_back(sm::make_derive("blocks_read", [p]{ return stats.phases[p].bytes_read / datablock::record_size; },
+                                       sm::description("Records read by the phase"), {label}));
+        defs.push_back(sm::make_derive("blocks_written", [p]{ return stats.phases[p].bytes_written / datablock::record_size; },
+                                       sm::description("Records written by the phase"), {label}));
+    }
+    metrics.add_group("bigsort", {
+        sm::make_histogram("read_latency", []{ return stats.read_latency.to_metrics(); }, sm::description("Latency of the reads in microseconds")),
+        sm::make_histogram("write_latency", []{ return stats.write_latency.to_metrics(); }, sm::description("Latency of the writes in microseconds")),
+        sm::make_gauge("reads_in_flight", []{ return stats.reads_in_flight; }, sm::description("Reads in flight")),
+        sm::make_gauge("writes_in_flight", []{ return stats.writes_in_flight; }, sm::description("Writes in flight")),
+        sm::make_derive("sort_compares", []{ return datablock::sort_compares(); }, sm::description("Compares of the partition sorts")),
+        sm::make_derive("merge_compares", []{ return stats.merge_compares; }, sm::description("Compares of the merges")),
+        sm::make_histogram("partition_sort_time", []{ return stats.partition_sort_time.to_metrics(); },
+                           sm::description("Time to sort a partition in microseconds")),
+        sm::make_derive("merge_stall_us", []{ return std::chrono::duration_cast<std::chrono::microseconds>(stats.merge_stall).count(); },
+                        sm::description("Time the merge waited for the read-ahead of the sorted files")),
+        sm::make_gauge("peak_memory", []{ return stats.peak_memory; }, sm::description("Peak of the memory allocated by the shard")),
+    });
+    for(auto& def:defs)
+        metrics.add_group("bigsort", {def});
+
+    memory_sampler.set_callback([]{ sample_memory(); });
+    memory_sampler.arm_periodic(memory_sample_period);
+}
+
+void unregister_metrics()
+{
+    memory_sampler.cancel();
+    metrics.clear();
+}
+
+// stats of a shard as seen from the shard that sums them
+struct shard_summary
+{
+    shard_stats stats;
+    uint64_t sort_compares;
+};
+
+// string as a JSON string literal
+static void write_json_string(std::ostringstream& out, const seastar::sstring& s)
+{
+    static const char* hex = "0123456789abcdef";
+    out << '"';
+    for(char c:s){
+        const unsigned char u = static_cast<unsigned char>(c);
+        if(c == '"' || c == '\\')
+            out << '\\' << c;
+        else if(u < 0x20)
+            out << "\\u00" << hex[u >> 4] << hex[u & 0xf];
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+static void write_latency(std::ostringstream& out, const char* name, const latency_histogram& h)
+{
+    out << "\"" << name << "\": {\"count\": " << h.count()
+        << ", \"mean\": " << (h.count() ? h.sum_us() / h.count() : 0)
+        << ", \"p50\": " << h.quantile_us(0.5)
+        << ", \"p99\": " << h.quantile_us(0.99)
+        << ", \"max\": " << h.max_us() << "}";
+}
+
+seastar::future<seastar::sstring> json_summary()
+{
+    return seastar::do_with(std::vector<shard_summary>(), [](auto& shards) {
+        return seastar::do_for_each(boost::counting_iterator<unsigned>(0),
+                                    boost::counting_iterator<unsigned>(seastar::smp::count),
+                                    [&shards](unsigned shard) {
+            return seastar::smp::submit_to(shard, []{
+                return shard_summary{stats, datablock::sort_compares()};
+            }).then([&shards](shard_summary summary){
+                shards.push_back(std::move(summary));
+            });
+        }).then([&shards]{
+            shard_stats total;
+            uint64_t sort_compares = 0;
+            for(auto& shard:shards){
+                for(size_t p = 0; p < phases_count; ++p){
+                    total.phases[p].bytes_read += shard.stats.phases[p].bytes_read;
+                    total.phases[p].bytes_written += shard.stats.phases[p].bytes_written;
+                }
+                total.read_latency.merge(shard.stats.read_latency);
+                total.write_latency.merge(shard.stats.write_latency);
+                total.max_reads_in_flight = std::max(total.max_reads_in_flight, shard.stats.max_reads_in_flight);
+                total.max_writes_in_flight = std::max(total.max_writes_in_flight, shard.stats.max_writes_in_flight);
+                total.merge_compares += shard.stats.merge_compares;
+                total.partition_sort_time.merge(shard.stats.partition_sort_time);
+                total.merge_stall += shard.stats.merge_stall;
+                // the shards allocate from their own memory, the largest peak is the one close to its share
+                total.peak_memory = std::max(total.peak_memory, shard.stats.peak_memory);
+                sort_compares += shard.sort_compares;
+            }
+
+            auto ms = [](clock_type::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+            std::ostringstream out;
+            out << "{\n  \"shards\": " << shards.size() << ",\n  \"record_size\": " << datablock::record_size << ",\n  \"phases\": {";
+            for(size_t p = 0; p < phases_count; ++p){
+                out << (p ? ", " : "") << "\n    \"" << phase_name(static_cast<phase>(p)) << "\": {"
+                    << "\"bytes_read\": " << total.phases[p].bytes_read
+                    << ", \"blocks_read\": " << total.phases[p].bytes_read / datablock::record_size
+                    << ", \"bytes_written\": " << total.phases[p].bytes_written
+                    << ", \"blocks_written\": " << total.phases[p].bytes_written / datablock::record_size << "}";
+            }
+            out << "\n  },\n  ";
+            write_latency(out, "read_latency_us", total.read_latency);
+            out << ",\n  ";
+            write_latency(out, "write_latency_us", total.write_latency);
+            out << ",\n  \"max_reads_in_flight\": " << total.max_reads_in_flight
+                << ",\n  \"max_writes_in_flight\": " << total.max_writes_in_flight
+                << ",\n  \"sort_compares\": " << sort_compares
+                << ",\n  \"merge_compares\": " << total.merge_compares
+                << ",\n  ";
+            write_latency(out, "partition_sort_us", total.partition_sort_time);
+            // after a parallel merge any shard merged a range of any sorted file, so a file has a stall per shard
+            out << ",\n  \"merge_stall_ms\": " << ms(total.merge_stall) << ",\n  \"run_stalls\": [";
+            bool first_stall = true;
+            for(size_t shard = 0; shard < shards.size(); ++shard){
+                for(auto& run:shards[shard].stats.run_stalls){
+                    out << (first_stall ? "" : ",") << "\n    {\"name\": ";
+                    write_json_string(out, run.name);
+                    out << ", \"shard\": " << shard << ", \"ms\": " << ms(run.stall) << "}";
+                    first_stall = false;
+                }
+            }
+            out << "\n  ],\n  \"max_shard_peak_memory\": " << total.peak_memory << "\n}\n";
+            return seastar::sstring(out.str());
+        });
+    });
+}
+
+}
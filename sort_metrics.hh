@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <seastar/core/future.hh>
+#include <seastar/core/metrics.hh>
+#include <seastar/core/sstring.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace sort_metrics {
+
+using clock_type = std::chrono::steady_clock;
+
+// phases of a sort, any I/O of a shard is accounted to its current phase
+enum class phase {
+    scan,
+    runs,
+    merge,
+    gather,
+    copy,
+    verify
+};
+
+const size_t phases_count(6);
+
+const char* phase_name(phase p);
+
+// Histogram of durations by buckets of powers of two microseconds, from 1us to about a minute.
+class latency_histogram
+{
+public:
+    static const size_t buckets = 27;
+
+    void add(clock_type::duration d);
+    void merge(const latency_histogram& other);
+
+    uint64_t count() const { return _count; }
+    double sum_us() const { return _sum_us; }
+    double max_us() const { return _max_us; }
+
+    // upper bound of the bucket holding the quantile q of the samples
+    double quantile_us(double q) const;
+
+    // cumulated buckets as exported by the prometheus endpoint
+    seastar::metrics::histogram to_metrics() const;
+
+private:
+    std::array<uint64_t, buckets> _counts{};
+    uint64_t _count = 0;
+    double _sum_us = 0;
+    double _max_us = 0;
+};
+
+struct phase_counters
+{
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+};
+
+// time the merge waited for the read-ahead of a sorted file
+struct run_stall
+{
+    seastar::sstring name;
+    clock_type::duration stall;
+};
+
+// counters of a shard
+struct shard_stats
+{
+    phase current = phase::scan;
+    std::array<phase_counters, phases_count> phases;
+    latency_histogram read_latency;
+    latency_histogram write_latency;
+    uint64_t reads_in_flight = 0;
+    uint64_t writes_in_flight = 0;
+    uint64_t max_reads_in_flight = 0;
+    uint64_t max_writes_in_flight = 0;
+    // compares of the merges, the compares of the sorts are counted by datablock::sort_compares()
+    uint64_t merge_compares = 0;
+    latency_histogram partition_sort_time;
+    clock_type::duration merge_stall = clock_type::duration::zero();
+    std::vector<run_stall> run_stalls;
+    size_t peak_memory = 0;
+
+    phase_counters& current_phase() { return phases[static_cast<size_t>(current)]; }
+};
+
+// stats of this shard
+shard_stats& local_stats();
+
+void set_phase(phase p);
+
+// update the peak of the memory allocated by this shard, called at any I/O completion and by a timer once the metrics are registered
+void sample_memory();
+
+// register the metrics of this shard, they are exported by the prometheus endpoint, and start sampling the memory.
+// Called once on any shard.
+void register_metrics();
+
+// stop sampling the memory and unregister the metrics of this shard, called on any shard before the reactor stops
+void unregister_metrics();
+
+// summary of the stats of all the shards as a JSON object, the counters are summed and the peak of the memory
+// is the largest peak of a shard
+seastar::future<seastar::sstring> json_summary();
+
+inline size_t io_bytes(size_t ret) {
+    return ret;
+}
+
+inline size_t io_bytes(const seastar::temporary_buffer<unsigned char>& buf) {
+    return buf.size();
+}
+
+// account a read of the current phase: its latency, the reads in flight and the bytes read
+template <typename T>
+seastar::future<T> track_read(seastar::future<T> io) {
+    auto& stats = local_stats();
+    stats.max_reads_in_flight = std::max(stats.max_reads_in_flight, ++stats.reads_in_flight);
+    const auto start = clock_type::now();
+    return io.then_wrapped([start](seastar::future<T> f) {
+        auto& stats = local_stats();
+        --stats.reads_in_flight;
+        stats.read_latency.add(clock_type::now() - start);
+        T result = f.get0();
+        stats.current_phase().bytes_read += io_bytes(result);
+        sample_memory();
+        return result;
+    });
+}
+
+// account a write of the current phase: its latency, the writes in flight and the bytes written
+inline seastar::future<size_t> track_write(seastar::future<size_t> io) {
+    auto& stats = local_stats();
+    stats.max_writes_in_flight = std::max(stats.max_writes_in_flight, ++stats.writes_in_flight);
+    const auto start = clock_type::now();
+    return io.then_wrapped([start](seastar::future<size_t> f) {
+        auto& stats = local_stats();
+        --stats.writes_in_flight;
+        stats.write_latency.add(clock_type::now() - start);
+        const size_t written = f.get0();
+        stats.current_phase().bytes_written += written;
+        sample_memory();
+        return written;
+    });
+}
+
+}
@@ -20,150 +20,1770 @@
  */
 
 #include "sort_strategies.hh"
+#include "loser_tree.hh"
+#include "front_coding.hh"
+#include "sort_metrics.hh"
+#include <seastar/core/semaphore.hh>
 #include <seastar/core/thread.hh>
+#include <seastar/core/memory.hh>
+#include <seastar/core/smp.hh>
 #include <boost/iterator/counting_iterator.hpp>
 #include <exception>
 #include <algorithm>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
 
 namespace sort_algorithm {
 
-const int file_index_uninited(-1);
+// window of consecutive blocks of a sorted file loaded in memory
+struct read_ahead_buffer
+{
+    datablock::blocks_ptr data;
+    uint64_t first_block = 0;
+    uint64_t blocks = 0;
+};
 
+// Reader of the blocks [first_block, end_block) of a sorted file used by the merge.
+// The reader keeps two windows of window_units units: the front one is consumed by the merge
+// while the back one is filled in background by a single large read.
+// The merge waits for the disk only when the front window is empty and the back one is not yet loaded.
+// A unit is a record for a raw file and a page for a front coded file, whose blocks are decoded
+// one at time over the head block. A sorted partition kept in memory is read from its arena instead.
 struct disk_block_reader
 {
-    disk_block_reader(seastar::file&& f, uint32_t findex, uint32_t num_of_blocks):
+    disk_block_reader(std::shared_ptr<datablock::block_arena> arena, uint32_t findex, uint64_t first_block, uint64_t end_block):
+        resident(std::move(arena)),
+        file_index(findex),
+        block_index(first_block),
+        end_block(end_block),
+        window_units(0),
+        prefetch(seastar::make_ready_future<>()){}
+
+    disk_block_reader(seastar::file&& f, uint32_t findex, uint64_t first_block, uint64_t end_block, size_t window):
         file(std::move(f)),
         file_index(findex),
-        block_index(0),
-        number_of_blocks(num_of_blocks){}
+        block_index(first_block),
+        end_block(end_block),
+        end_unit(end_block),
+        window_units(std::max<uint64_t>(1, std::min<uint64_t>(window / datablock::record_size, end_block - first_block))),
+        prefetch(seastar::make_ready_future<>()){}
+
+    // reader of a front coded file of file_pages pages holding end_block blocks, it's read from the first block
+    static disk_block_reader front_coded(seastar::file&& f, uint32_t findex, uint64_t end_block, uint64_t file_pages, size_t window) {
+        disk_block_reader reader(std::move(f), findex, 0, end_block, datablock::spill_page_size);
+        reader.unit_size = datablock::spill_page_size;
+        reader.end_unit = file_pages;
+        reader.window_units = std::max<uint64_t>(1, std::min<uint64_t>(window / datablock::spill_page_size, file_pages));
+        return reader;
+    }
 
-    bool is_hexausted() {
-        return block_index == number_of_blocks;
+    bool is_hexausted() const {
+        return block_index == end_block;
     };
 
+    bool coded() const {
+        return unit_size == datablock::spill_page_size;
+    }
+
+    // block at the head of the file
+    const unsigned char* cached_block() const {
+        if(resident)
+            return resident->block(block_index);
+        if(coded())
+            return head.get();
+        return front.data.get() + (block_index - front.first_block) * unit_size;
+    }
+
+    // load the first window and start to prefetch the next one
+    seastar::future<> start() {
+        if(is_hexausted())
+            return seastar::make_ready_future<>();
+        if(resident){
+            head_prefix = datablock::block_prefix(cached_block());
+            return seastar::make_ready_future<>();
+        }
+        front.data = seastar::allocate_aligned_buffer<unsigned char>(window_bytes(), block_size);
+        back.data = seastar::allocate_aligned_buffer<unsigned char>(window_bytes(), block_size);
+        if(coded())
+            head = seastar::allocate_aligned_buffer<unsigned char>(datablock::record_size, block_size);
+        return read_window(front, coded() ? 0 : block_index).then([this]{
+            if(coded()){
+                page = 0;
+                decoder.reset(front.data.get());
+                decoder.next(head.get());
+            }
+            head_prefix = datablock::block_prefix(cached_block());
+            start_prefetch();
+        });
+    }
+
+    // move the head to the next block
+    seastar::future<> next() {
+        ++block_index;
+        if(is_hexausted())
+            return seastar::make_ready_future<>();
+        if(resident || (!coded() && block_index < front.first_block + front.blocks)){
+            head_prefix = datablock::block_prefix(cached_block());
+            return seastar::make_ready_future<>();
+        }
+        if(coded() && (decoder.remaining() || page + 1 < front.blocks)){
+            if(!decoder.remaining())
+                decoder.reset(front.data.get() + ++page * unit_size);
+            decoder.next(head.get());
+            head_prefix = datablock::block_prefix(cached_block());
+            return seastar::make_ready_future<>();
+        }
+
+        // front window is empty, switch to the back one as soon as it's loaded.
+        // the time the merge waits for the read-ahead is the stall of this file
+        auto loaded = std::move(prefetch);
+        prefetch = seastar::make_ready_future<>();
+        const bool waiting = !loaded.available();
+        const auto start = sort_metrics::clock_type::now();
+        return loaded.then([this, waiting, start]{
+            if(waiting)
+                stall += sort_metrics::clock_type::now() - start;
+            std::swap(front, back);
+            if(coded()){
+                page = 0;
+                decoder.reset(front.data.get());
+                decoder.next(head.get());
+            }
+            head_prefix = datablock::block_prefix(cached_block());
+            start_prefetch();
+        });
+    }
+
+    // wait the prefetch in flight, that writes to the back window, and close the file.
+    // An error of the prefetch is dropped, the merge is over when the reader is closed
+    seastar::future<> close() {
+        if(resident)
+            return seastar::make_ready_future<>();
+        auto pending = std::move(prefetch);
+        prefetch = seastar::make_ready_future<>();
+        return pending.handle_exception([](std::exception_ptr){}).then([f=file]() mutable {
+            return f.close().finally([f]{});
+        });
+    }
+
     seastar::file file;
+    std::shared_ptr<datablock::block_arena> resident;
     uint32_t file_index;
-    uint32_t block_index;
-    uint32_t number_of_blocks;
-    datablock::blocks_ptr cached_block;
+    uint64_t block_index;
+    uint64_t end_block;
+    // bytes and number of the units of the file
+    size_t unit_size = datablock::record_size;
+    uint64_t end_unit = 0;
+    size_t window_units;
+    // key prefix of the head block, see datablock::block_prefix
+    uint64_t head_prefix = 0;
+    // windows of units, first_block and blocks count units
+    read_ahead_buffer front;
+    read_ahead_buffer back;
+    seastar::future<> prefetch;
+    // head block of a front coded file and its page in the front window
+    datablock::blocks_ptr head;
+    datablock::page_decoder decoder;
+    uint64_t page = 0;
+    sort_metrics::clock_type::duration stall = sort_metrics::clock_type::duration::zero();
+
+private:
+    void start_prefetch() {
+        const uint64_t next_unit = front.first_block + front.blocks;
+        if(next_unit < end_unit)
+            prefetch = read_window(back, next_unit);
+    }
+
+    // the windows are rounded up to whole blocks, records smaller than a block are read many per block
+    size_t window_bytes() const {
+        return (window_units * unit_size + block_size - 1) / block_size * block_size;
+    }
+
+    seastar::future<> read_window(read_ahead_buffer& buf, uint64_t first_unit) {
+        buf.first_block = first_unit;
+        buf.blocks = std::min<uint64_t>(window_units, end_unit - first_unit);
+        const uint64_t pos = first_unit * unit_size;
+        const size_t len = buf.blocks * unit_size;
+        if(pos % block_size){
+            // a range starting inside a block, the read is aligned by seastar
+            return sort_metrics::track_read(file.dma_read<unsigned char>(pos, len)).then([&buf, len](seastar::temporary_buffer<unsigned char> data){
+                std::copy(data.get(), data.get() + data.size(), buf.data.get());
+                std::fill(buf.data.get() + data.size(), buf.data.get() + len, 0);
+            });
+        }
+        const size_t aligned_len = (len + block_size - 1) / block_size * block_size;
+        return sort_metrics::track_read(file.dma_read(pos, buf.data.get(), aligned_len)).then([&buf, len](size_t ret){
+            if(ret < len){
+                // the last block of the file could be not complete
+                std::fill(buf.data.get() + ret, buf.data.get() + len, 0);
+            }
+        });
+    }
+};
+
+// compare the cached blocks at the head of two readers,
+// blocks are compared only when their key prefixes are equal
+struct cached_block_compare
+{
+    cached_block_compare(std::vector<disk_block_reader>* readers = nullptr, uint64_t* blocks_compares = nullptr):
+        blocks_readers(readers),
+        full_compares(blocks_compares){}
+
+    int operator()(size_t a, size_t b) const {
+        const auto& x = (*blocks_readers)[a];
+        const auto& y = (*blocks_readers)[b];
+        if(x.head_prefix != y.head_prefix)
+            return x.head_prefix < y.head_prefix ? -1 : 1;
+        ++*full_compares;
+        return datablock::compare_keys(x.cached_block(), y.cached_block(), datablock::block_prefix_size);
+    }
+
+    std::vector<disk_block_reader>* blocks_readers;
+    uint64_t* full_compares;
 };
 
 struct external_sort_info
 {
-    external_sort_info():current_min_file_index(file_index_uninited){}
-    int current_min_file_index;
+    uint64_t merged_blocks = 0;
+    uint64_t full_compares = 0;
     std::vector<disk_block_reader> blocks_readers;
+    loser_tree<cached_block_compare> tree;
+};
+
+// state of the internal sort of a shard
+struct internal_sort_info
+{
+    internal_sort_info(size_t capacity, size_t partitions, uint64_t first_block):
+        capacity(capacity), free_partitions(partitions), partitions(partitions), first_block(first_block), blocks_fetched(0){}
+
+    size_t capacity;
+    // partitions allocated and not in use, any partition is allocated the first time it's needed
+    std::vector<std::unique_ptr<datablock::block_arena>> free_arenas;
+    std::unique_ptr<datablock::block_arena> current;
+    // one unit for any partition, the read of the next partition waits a partition that is sorted and spilled
+    seastar::semaphore free_partitions;
+    size_t partitions;
+    // first block of the range, the blocks of a partition are numbered from first_block + blocks_fetched
+    uint64_t first_block;
+    uint64_t blocks_fetched;
+    std::vector<run_info> runs;
+    std::exception_ptr error;
 };
 
-seastar::future<> update_cached_block(disk_block_reader& block_reader){
+// take a partition to be filled, waiting one of the partitions that are sorted and spilled in background
+static seastar::future<> acquire_partition(internal_sort_info& info)
+{
+    return info.free_partitions.wait(1).then([&info]{
+        if(info.free_arenas.empty()){
+            info.current = std::make_unique<datablock::block_arena>(info.capacity);
+        }else{
+            info.current = std::move(info.free_arenas.back());
+            info.free_arenas.pop_back();
+        }
+    });
+}
+
+// keep the first limit blocks of a sorted partition, 0 keeps all the blocks
+static void truncate_partition(datablock::block_arena& partition, uint64_t limit)
+{
+    if(limit && partition.size() > limit)
+        partition.order().resize(limit);
+}
+
+// sort the current partition and write it to disk in background, the partition is given back when written.
+// The last partition is kept in memory when opts.keep_last is set.
+static seastar::future<> spill_partition(internal_sort_info& info, seastar::sstring run_prefix, const run_options& opts, bool last)
+{
+    if(info.error)
+        return seastar::make_exception_future<>(info.error);
+
+    auto arena = std::move(info.current);
+    seastar::sstring name = run_prefix + "." + std::to_string(info.runs.size() + 1);
+    if(last && opts.keep_last){
+        std::shared_ptr<datablock::block_arena> resident(std::move(arena));
+        info.runs.push_back(run_info{name, resident->size(), resident});
+        const size_t run_index = info.runs.size() - 1;
+        // the partition is sorted in background as well, the runs are used once all the partitions are given back
+        const auto start = sort_metrics::clock_type::now();
+        datablock::sort_blocks_async(*resident, opts.mode).then_wrapped([&info, resident, run_index, limit=opts.limit, start](auto f) mutable {
+            try {
+                f.get();
+                sort_metrics::local_stats().partition_sort_time.add(sort_metrics::clock_type::now() - start);
+                truncate_partition(*resident, limit);
+                info.runs[run_index].blocks = resident->size();
+                std::cout << "keep " << resident->size() << " blocks in memory" << std::endl;
+            } catch(...) {
+                info.error = std::current_exception();
+            }
+            info.free_partitions.signal(1);
+        });
+        return seastar::make_ready_future<>();
+    }
+    info.runs.push_back(run_info{name, arena->size()});
+    const size_t run_index = info.runs.size() - 1;
+    // block of the file in the first slot of the partition
+    const uint64_t source_first = info.first_block + info.blocks_fetched - arena->size();
 
-    // get block data from cache if available
-    if(!block_reader.cached_block){
-        datablock::blocks_ptr rbuf = seastar::allocate_aligned_buffer<unsigned char>(block_size, block_size);
-        return block_reader.file.dma_read(block_reader.block_index * block_size, rbuf.get(), block_size)
-        .then([rbuf=std::move(rbuf), &block_reader](size_t ret) mutable {
-            if(ret < block_size){
-                std::cout << " Read error read " << ret << "bytes expected size is " << block_size << std::endl;
+    auto& partition = *arena;
+    const auto mode = opts.mode;
+    // the sort runs in a seastar thread that yields to the reads and the writes in flight
+    const auto start = sort_metrics::clock_type::now();
+    datablock::sort_blocks_async(partition, mode).then([&info, &partition, name, run_index, source_first, opts, start]{
+        sort_metrics::local_stats().partition_sort_time.add(sort_metrics::clock_type::now() - start);
+        // the blocks after the limit can't be in the first limit blocks of the sorted order
+        truncate_partition(partition, opts.limit);
+        info.runs[run_index].blocks = partition.size();
+        if(opts.key_pointer)
+            return file_utils::write_key_records(partition, source_first, name, opts.output);
+        if(opts.spill != datablock::spill_format::front_coded)
+            return file_utils::write_blocks(partition, name, opts.output);
+        return seastar::do_with(std::vector<datablock::coded_entry>(), [&info, &partition, name, run_index, opts](auto& entries){
+            const uint64_t coded_bytes = datablock::front_code(partition, entries);
+            const uint64_t raw_bytes = partition.size() * datablock::record_size;
+            if(coded_bytes > raw_bytes * opts.max_spill_ratio){
+                std::cout << "front coding saves too little on " << name << ", write it raw" << std::endl;
+                return file_utils::write_blocks(partition, name, opts.output);
             }
+            std::cout << "front coding of " << name << " -- " << coded_bytes * 100 / std::max<uint64_t>(raw_bytes, 1) << "% of raw size" << std::endl;
+            info.runs[run_index].format = datablock::spill_format::front_coded;
+            return file_utils::write_front_coded(partition, entries, name, opts.output);
+        });
+    }).then_wrapped([&info, arena=std::move(arena), name](auto f) mutable {
+        try {
+            f.get();
+            std::cout << "write " << arena->size() << " blocks on disk -- file " << name << std::endl;
+        } catch(...) {
+            info.error = std::current_exception();
+        }
+        arena->reset(); //reuse memory blocks for the next partition
+        info.free_arenas.push_back(std::move(arena));
+        info.free_partitions.signal(1);
+    });
+    return seastar::make_ready_future<>();
+}
 
-            block_reader.cached_block = std::move(rbuf);
-            return seastar::make_ready_future();
+// wait the partitions sorted and written in background, whatever the outcome of the reads,
+// and give the runs or the first error. The partition being filled when a read failed holds a unit.
+static seastar::future<std::vector<run_info>> drain_partitions(internal_sort_info& info, seastar::future<> reads)
+{
+    return reads.then_wrapped([&info](auto f) {
+        const size_t units = info.partitions - (info.current ? 1 : 0);
+        return info.free_partitions.wait(units).then([&info, units, f=std::move(f)]() mutable {
+            info.free_partitions.signal(units);
+            info.current.reset();
+            try {
+                f.get();
+            } catch(...) {
+                return seastar::make_exception_future<std::vector<run_info>>(std::current_exception());
+            }
+            if(info.error)
+                return seastar::make_exception_future<std::vector<run_info>>(info.error);
+            return seastar::make_ready_future<std::vector<run_info>>(std::move(info.runs));
         });
+    });
+}
+
+// entry of the replacement selection heap, blocks of the current run come first
+struct selection_entry
+{
+    uint32_t run;
+    uint64_t prefix;
+    // input order, keeps equal blocks stable
+    uint64_t seq;
+    uint32_t slot;
+};
+
+// order of the heap, true when a comes after b
+struct selection_after
+{
+    const datablock::block_arena* arena;
+
+    bool operator()(const selection_entry& a, const selection_entry& b) const {
+        if(a.run != b.run)
+            return a.run > b.run;
+        if(a.prefix != b.prefix)
+            return a.prefix > b.prefix;
+        const int cmp = datablock::compare_keys(arena->slot(a.slot), arena->slot(b.slot), datablock::block_prefix_size);
+        if(cmp != 0)
+            return cmp > 0;
+        return a.seq > b.seq;
     }
-    return seastar::make_ready_future();
 };
 
-// External_sort operate by reading blocks from the head of any file involved that ware previously sorted by internal sort algo.
-// Two blocks at time are compared to keep the min value that is stored in memory at each step.
-// To perform the algo is needed a list of current block index position iniside any file.
-// When the index position of a file reach the number of blocks inside the file, the file is considered hexausted.
-// The algo stop when all files are hexausted.
-seastar::future<> external_sort(seastar::sstring root_filename, int files_count)
+struct replacement_selection_info
 {
-    // create the out file to write the ordered blocks sequence
-    return seastar::open_file_dma(root_filename + ".sorted", seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
-    .then([files_count, root_filename=std::move(root_filename)](seastar::file of){
-
-        external_sort_info sort_info;
-        size_t block_ndx = 0;
-        return seastar::do_with(std::move(sort_info), std::move(of), std::move(block_ndx),
-                                [files_count=std::move(files_count), root_filename=std::move(root_filename)](
-                                    auto& sort_info, auto &of, auto &block_ndx) mutable {
-            // open the files of the set containing sorted blocks
-            // and initialize the blocks_readers.
-            return seastar::do_for_each(boost::counting_iterator<uint32_t>(1),
-                                        boost::counting_iterator<uint32_t>(files_count+1),
-                                        [root_filename=std::move(root_filename), &sort_info, &of](auto& file_ndx) mutable {
-                return seastar::open_file_dma(root_filename + "." + std::to_string(file_ndx), seastar::open_flags::rw)
-                .then([&sort_info, file_ndx](seastar::file f) mutable {
-                    return f.size().then([&sort_info, f, file_ndx](size_t size) mutable {
-                        // handle file size not multiple of block size by size%block_size==0
-                        sort_info.blocks_readers.emplace_back(
-                            disk_block_reader(std::move(f), file_ndx, size/block_size + (size%block_size==0?0:1)));
+    replacement_selection_info(size_t capacity, uint64_t limit):arena(capacity), seq(0), limit(limit){}
+
+    datablock::block_arena arena;
+    std::vector<selection_entry> heap;
+    uint64_t seq;
+    // blocks written by any run, 0 writes all the blocks
+    uint64_t limit;
+    std::unique_ptr<file_utils::block_writer> writer;
+    std::vector<run_info> runs;
+};
+
+// close the sorted file of the current run and create the next one
+static seastar::future<> start_run(replacement_selection_info& info, seastar::sstring run_prefix, file_utils::writer_options output)
+{
+    auto closed = info.writer ? info.writer->close() : seastar::make_ready_future<>();
+    return closed.then([&info, run_prefix, output]{
+        if(!info.runs.empty())
+            std::cout << "write " << info.runs.back().blocks << " blocks on disk -- file " << info.runs.back().name << std::endl;
+        seastar::sstring name = run_prefix + "." + std::to_string(info.runs.size() + 1);
+        info.runs.push_back(run_info{name, 0});
+        return seastar::open_file_dma(name, seastar::open_flags::wo|seastar::open_flags::create|seastar::open_flags::truncate)
+        .then([&info, output](seastar::file f){
+            info.writer = std::make_unique<file_utils::block_writer>(std::move(f), 0, output);
+        });
+    });
+}
+
+// write the min block of the heap to its run, its slot is free when the returned future is resolved
+static seastar::future<selection_entry> emit_min(replacement_selection_info& info, seastar::sstring run_prefix, file_utils::writer_options output)
+{
+    std::pop_heap(info.heap.begin(), info.heap.end(), selection_after{&info.arena});
+    const selection_entry min = info.heap.back();
+    info.heap.pop_back();
+
+    auto ready = min.run + 1 == info.runs.size() ? seastar::make_ready_future<>() : start_run(info, run_prefix, output);
+    return ready.then([&info, min]{
+        // the blocks of a run after the limit can't be in the first limit blocks of the sorted order
+        if(info.limit && info.runs.back().blocks == info.limit)
+            return seastar::make_ready_future<>();
+        ++info.runs.back().blocks;
+        return info.writer->write(info.arena.slot(min.slot), datablock::record_size);
+    }).then([min]{
+        return min;
+    });
+}
+
+static void push_selection(replacement_selection_info& info, uint32_t run, uint32_t slot)
+{
+    info.heap.push_back(selection_entry{run, datablock::block_prefix(info.arena.slot(slot)), info.seq++, slot});
+    std::push_heap(info.heap.begin(), info.heap.end(), selection_after{&info.arena});
+}
+
+// Replacement selection: the blocks stream through a heap as large as the memory. The min block is written to the
+// current run and replaced by the next input block, that joins the current run if it is not lower than the block
+// just written, or the next run otherwise. Random input gives runs of about twice the memory, sorted input a single run.
+static seastar::future<std::vector<run_info>> replacement_selection_sort(seastar::sstring fname, uint64_t first_block, uint64_t last_block,
+                                                                         seastar::sstring run_prefix, run_options opts)
+{
+    const uint64_t blocks = last_block > first_block ? last_block - first_block : 0;
+    const size_t capacity = std::min<uint64_t>(std::max<size_t>(opts.memory / datablock::record_size, 1), std::max<uint64_t>(blocks, 1));
+    return seastar::do_with(replacement_selection_info(capacity, opts.limit), [fname, first_block, last_block, run_prefix, opts](auto& info) mutable {
+        info.heap.reserve(info.arena.capacity());
+        return file_utils::read_extents_from_file(fname, [&info, run_prefix, opts](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+            return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                        boost::counting_iterator<uint64_t>(count),
+                                        [&info, run_prefix, opts, data](uint64_t i){
+                const unsigned char* block = data + i * datablock::record_size;
+                if(!info.arena.full()){
+                    push_selection(info, 0, info.arena.push_back(block));
+                    return seastar::make_ready_future<>();
+                }
+                return emit_min(info, run_prefix, opts.output).then([&info, block](selection_entry min){
+                    // a block lower than the last written one can't join the current run
+                    const uint32_t run = datablock::compare_blocks(block, info.arena.slot(min.slot)) < 0 ? min.run + 1 : min.run;
+                    std::copy(block, block + datablock::record_size, info.arena.slot(min.slot));
+                    push_selection(info, run, min.slot);
+                });
+            });
+        }, opts.input, first_block, last_block).then([&info, run_prefix, opts]{
+            return seastar::do_until([&info]{ return info.heap.empty(); }, [&info, run_prefix, opts]{
+                return emit_min(info, run_prefix, opts.output).discard_result();
+            });
+        }).then([&info]{
+            if(!info.writer)
+                return seastar::make_ready_future<>();
+            return info.writer->close().then([&info]{
+                std::cout << "write " << info.runs.back().blocks << " blocks on disk -- file " << info.runs.back().name << std::endl;
+            });
+        }).then([&info]{
+            return std::move(info.runs);
+        });
+    });
+}
+
+// state of the top-k sort of a shard
+struct top_k_info
+{
+    explicit top_k_info(size_t capacity):arena(std::make_shared<datablock::block_arena>(capacity)), seq(0){
+        heap.reserve(capacity);
+    }
+
+    // the max first: a comes before b when b comes after a in the sorted order
+    bool before(const selection_entry& a, const selection_entry& b) const {
+        return selection_after{arena.get()}(b, a);
+    }
+
+    // a block enters the heap when it's lower than the max that leaves it
+    void push(const unsigned char* data, uint64_t count) {
+        auto& blocks = *arena;
+        auto cmp = [this](const selection_entry& a, const selection_entry& b){ return before(a, b); };
+        for(uint64_t i = 0; i < count; ++i, ++seq){
+            const unsigned char* block = data + i * datablock::record_size;
+            uint32_t slot;
+            if(!blocks.full()){
+                slot = blocks.push_back(block);
+            }else{
+                if(datablock::compare_blocks(block, blocks.slot(heap.front().slot)) >= 0)
+                    continue;
+                std::pop_heap(heap.begin(), heap.end(), cmp);
+                slot = heap.back().slot;
+                heap.pop_back();
+                std::copy(block, block + datablock::record_size, blocks.slot(slot));
+            }
+            heap.push_back(selection_entry{0, datablock::block_prefix(blocks.slot(slot)), seq, slot});
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+    }
+
+    std::shared_ptr<datablock::block_arena> arena;
+    // max heap of the blocks kept, a later block equal to a kept one comes after it
+    std::vector<selection_entry> heap;
+    uint64_t seq;
+};
+
+// sort the blocks kept by the heap to a single sorted file, kept in memory when opts.keep_last is set
+static seastar::future<std::vector<run_info>> top_k_runs(top_k_info& info, seastar::sstring run_prefix, const run_options& opts)
+{
+    std::sort_heap(info.heap.begin(), info.heap.end(), [&info](const selection_entry& a, const selection_entry& b){
+        return info.before(a, b);
+    });
+    auto& order = info.arena->order();
+    for(size_t i = 0; i < info.heap.size(); ++i)
+        order[i] = info.heap[i].slot;
+
+    std::vector<run_info> runs;
+    if(order.empty())
+        return seastar::make_ready_future<std::vector<run_info>>(std::move(runs));
+    seastar::sstring name = run_prefix + ".1";
+    if(opts.keep_last){
+        std::cout << "keep the first " << order.size() << " blocks in memory" << std::endl;
+        runs.push_back(run_info{name, order.size(), info.arena});
+        return seastar::make_ready_future<std::vector<run_info>>(std::move(runs));
+    }
+    runs.push_back(run_info{name, order.size()});
+    return file_utils::write_blocks(*info.arena, name, opts.output).then([runs=std::move(runs)]() mutable {
+        std::cout << "write the first " << runs[0].blocks << " blocks on disk -- file " << runs[0].name << std::endl;
+        return std::move(runs);
+    });
+}
+
+// Top-k sort: the blocks stream through a max heap of the opts.limit smallest blocks, a block enters the heap
+// when it's lower than the max that leaves it, so any block is compared once to the max and the memory is bound by the limit.
+// The blocks kept are sorted to a single sorted file, kept in memory when opts.keep_last is set.
+static seastar::future<std::vector<run_info>> top_k_sort(seastar::sstring fname, uint64_t first_block, uint64_t last_block,
+                                                         seastar::sstring run_prefix, run_options opts)
+{
+    const uint64_t blocks = last_block > first_block ? last_block - first_block : 0;
+    const size_t capacity = std::max<uint64_t>(std::min(opts.limit, blocks), 1);
+    return seastar::do_with(top_k_info(capacity), [fname, first_block, last_block, run_prefix, opts](auto& info) {
+        return file_utils::read_extents_from_file(fname, [&info](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+            info.push(data, count);
+        }, opts.input, first_block, last_block).then([&info, run_prefix, opts]{
+            return top_k_runs(info, run_prefix, opts);
+        });
+    });
+}
+
+seastar::future<std::vector<run_info>> internal_sort(seastar::sstring fname, uint64_t first_block, uint64_t last_block,
+                                                     seastar::sstring run_prefix, run_options opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::runs);
+    // key-pointer sorted files are made by sorting partitions that are written as key records only
+    if(opts.key_pointer)
+        opts.keep_last = false;
+    else if(opts.limit && opts.limit <= opts.memory / datablock::record_size)
+        return top_k_sort(fname, first_block, last_block, run_prefix, opts);
+    else if(opts.generator == run_generator::replacement)
+        return replacement_selection_sort(fname, first_block, last_block, run_prefix, opts);
+
+    // the memory is split among the partitions, the partition memory is reserved once and reused by any partition.
+    // a range that fits the memory is a single partition
+    const uint64_t blocks = last_block > first_block ? last_block - first_block : 0;
+    const size_t partitions = blocks <= opts.memory / datablock::record_size ? 1 : std::max<size_t>(opts.partitions, 1);
+    const size_t capacity = std::min<uint64_t>(std::max<size_t>(opts.memory / datablock::record_size / partitions, 1), std::max<uint64_t>(blocks, 1));
+    return seastar::do_with(internal_sort_info(capacity, partitions, first_block), [fname, first_block, last_block, run_prefix, opts](auto& info) mutable {
+        return drain_partitions(info, file_utils::read_extents_from_file(fname, [&info, run_prefix, opts](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+            return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                        boost::counting_iterator<uint64_t>(count),
+                                        [&info, run_prefix, opts, data, blocks_tot](uint64_t i){
+                auto ready = info.current ? seastar::make_ready_future<>() : acquire_partition(info);
+                return ready.then([&info, run_prefix, opts, data, blocks_tot, i]{
+                    info.current->push_back(data + i * datablock::record_size);
+                    ++info.blocks_fetched;
+                    if(!info.current->full() && info.blocks_fetched != blocks_tot)
                         return seastar::make_ready_future();
+
+                    //sort and save to disk while the next partition is read
+                    return spill_partition(info, run_prefix, opts, info.blocks_fetched == blocks_tot);
+                });
+            });
+        }, opts.input, first_block, last_block));
+    });
+}
+
+// blocks read from a stream and not yet pushed to a partition
+struct stream_input
+{
+    stream_input(seastar::pollable_fd& in, size_t size):in(in), buffer(size), used(0), eof(false){}
+
+    seastar::pollable_fd& in;
+    std::vector<unsigned char> buffer;
+    size_t used;
+    bool eof;
+};
+
+// Read the stream up to its end and hand its blocks to push(data, count), a future.
+// Any read fills up to the free space of the buffer, the partial block left by a read is moved to the front of the buffer,
+// the partial block at the end of the stream is padded by zeros.
+template <typename Push>
+static seastar::future<> read_stream(stream_input& input, Push push)
+{
+    return seastar::do_until([&input]{ return input.eof; }, [&input, push]() mutable {
+        char* free_space = reinterpret_cast<char*>(input.buffer.data() + input.used);
+        return sort_metrics::track_read(input.in.read_some(free_space, input.buffer.size() - input.used))
+        .then([&input, push](size_t n) mutable {
+            input.used += n;
+            if(n == 0){
+                input.eof = true;
+                const size_t padding = (datablock::record_size - input.used % datablock::record_size) % datablock::record_size;
+                std::fill(input.buffer.begin() + input.used, input.buffer.begin() + input.used + padding, 0);
+                input.used += padding;
+            }
+            const uint64_t count = input.used / datablock::record_size;
+            return push(input.buffer.data(), count).then([&input, count]{
+                const size_t pushed = count * datablock::record_size;
+                std::copy(input.buffer.begin() + pushed, input.buffer.begin() + input.used, input.buffer.begin());
+                input.used -= pushed;
+            });
+        });
+    });
+}
+
+// push the blocks to the current partition, a full partition is sorted and written in background
+static seastar::future<> push_blocks(internal_sort_info& info, const unsigned char* data, uint64_t count,
+                                     seastar::sstring run_prefix, const run_options& opts)
+{
+    return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                boost::counting_iterator<uint64_t>(count),
+                                [&info, run_prefix, opts, data](uint64_t i){
+        auto ready = info.current ? seastar::make_ready_future<>() : acquire_partition(info);
+        return ready.then([&info, run_prefix, opts, data, i]{
+            info.current->push_back(data + i * datablock::record_size);
+            ++info.blocks_fetched;
+            if(!info.current->full())
+                return seastar::make_ready_future();
+            return spill_partition(info, run_prefix, opts, false);
+        });
+    });
+}
+
+seastar::future<std::vector<run_info>> stream_internal_sort(seastar::pollable_fd& in, seastar::sstring run_prefix, run_options opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::runs);
+    if(opts.key_pointer)
+        return seastar::make_exception_future<std::vector<run_info>>(std::invalid_argument("key-pointer sorted files can't point to the blocks of a stream"));
+
+    // any read fills up to extent_size bytes
+    const size_t read_size = std::max(opts.input.extent_size, datablock::record_size);
+    if(opts.limit && opts.limit <= opts.memory / datablock::record_size){
+        // the first limit blocks fit the memory, the stream goes through the bounded heap of top_k_sort
+        return seastar::do_with(top_k_info(opts.limit), stream_input(in, read_size + datablock::record_size),
+                                [run_prefix, opts](auto& info, auto& input) {
+            return read_stream(input, [&info](const unsigned char* data, uint64_t count){
+                info.push(data, count);
+                return seastar::make_ready_future<>();
+            }).then([&info, run_prefix, opts]{
+                std::cout << "read " << info.seq << " blocks from the stream" << std::endl;
+                return top_k_runs(info, run_prefix, opts);
+            });
+        });
+    }
+
+    // the length of the stream is unknown, the memory is always split among the partitions
+    const size_t partitions = std::max<size_t>(opts.partitions, 1);
+    const size_t capacity = std::max<size_t>(opts.memory / datablock::record_size / partitions, 1);
+    return seastar::do_with(internal_sort_info(capacity, partitions, 0), stream_input(in, read_size + datablock::record_size),
+                            [run_prefix, opts](auto& info, auto& input) {
+        auto reads = read_stream(input, [&info, run_prefix, opts](const unsigned char* data, uint64_t count){
+            return push_blocks(info, data, count, run_prefix, opts);
+        }).then([&info, run_prefix, opts]{
+            // the partition being filled is the last one
+            return info.current ? spill_partition(info, run_prefix, opts, true) : seastar::make_ready_future<>();
+        });
+        return drain_partitions(info, std::move(reads)).then([&info](std::vector<run_info> runs){
+            std::cout << "read " << info.blocks_fetched << " blocks from the stream" << std::endl;
+            return runs;
+        });
+    });
+}
+
+seastar::future<std::vector<run_info>> parallel_internal_sort(seastar::sstring fname, run_options opts)
+{
+    return seastar::open_file_dma(fname, seastar::open_flags::ro).then([fname, opts](seastar::file f) mutable {
+        return f.size().then([fname, opts](uint64_t size) mutable {
+            // any shard sorts a range of blocks using its share of memory
+            const uint64_t blocks_tot = size / datablock::record_size + (size % datablock::record_size == 0 ? 0 : 1);
+            const unsigned shards = seastar::smp::count;
+            if(shards == 1 || blocks_tot * datablock::record_size <= opts.memory / shards){
+                // the sorted files are merged by this shard, so the last partition can stay in memory
+                opts.memory = std::min(opts.memory / shards, seastar::memory::stats().free_memory() / 2);
+                return internal_sort(fname, 0, blocks_tot, fname + ".0", opts);
+            }
+            // partitions kept in memory would be read by other shards during the parallel merge
+            opts.keep_last = false;
+            return seastar::do_with(std::vector<std::vector<run_info>>(shards), [fname, opts, blocks_tot, shards](auto& manifests) {
+                return seastar::parallel_for_each(boost::counting_iterator<unsigned>(0),
+                                                  boost::counting_iterator<unsigned>(shards),
+                                                  [fname, opts, blocks_tot, shards, &manifests](unsigned shard) {
+                    const uint64_t first_block = blocks_tot * shard / shards;
+                    const uint64_t last_block = blocks_tot * (shard + 1) / shards;
+                    return seastar::smp::submit_to(shard, [fname, opts, first_block, last_block, shards, shard]() mutable {
+                        opts.memory = std::min(opts.memory / shards, seastar::memory::stats().free_memory() / 2);
+                        return internal_sort(fname, first_block, last_block, fname + "." + std::to_string(shard), opts);
+                    }).then([&manifests, shard](std::vector<run_info> runs){
+                        manifests[shard] = std::move(runs);
                     });
+                }).then([&manifests]{
+                    // gather the sorted files of all shards in input order
+                    std::vector<run_info> runs;
+                    for(auto& m:manifests)
+                        runs.insert(runs.end(), m.begin(), m.end());
+                    return runs;
                 });
-            }).then([files_count=std::move(files_count), &sort_info, &of, &block_ndx]() mutable {
-                // merge files sorting element at each step.
-                auto sort_is_done = [&sort_info]{ // todo: optimize removing hexausted element (better unordered_map instead of vector)
-                    for(auto &x:sort_info.blocks_readers)
-                    {
-                        if(!x.is_hexausted())
-                            return false;
+            });
+        }).finally([f]() mutable {
+            return f.close().finally([f]{});
+        });
+    });
+}
+
+struct input_scan_info
+{
+    input_scan_info():
+        last(seastar::allocate_aligned_buffer<unsigned char>(datablock::record_size, block_size)),
+        scanned(0), ascending(true), descending(true), eof(false){}
+
+    // last block of the previous extent
+    datablock::blocks_ptr last;
+    uint64_t scanned;
+    bool ascending;
+    bool descending;
+    bool eof;
+};
+
+seastar::future<input_order> scan_input_order(seastar::sstring fname, file_utils::reader_options opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::scan);
+    // the file is read by windows of queue_depth extents, the reads of a window are in flight together
+    const uint64_t window_blocks = std::max<uint64_t>(1, opts.extent_size / datablock::record_size) * std::max<size_t>(opts.queue_depth, 1);
+    // the file is opened once for all the windows
+    return seastar::open_file_dma(fname, seastar::open_flags::ro).then([opts, window_blocks](seastar::file f) {
+        return seastar::do_with(input_scan_info(), [f, opts, window_blocks](auto& info) {
+            return seastar::do_until([&info]{ return info.eof || (!info.ascending && !info.descending); },
+                                     [&info, f, opts, window_blocks]{
+                const uint64_t first_block = info.scanned;
+                return file_utils::read_extents_from_file(f, [&info](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+                    const unsigned char* prev = info.scanned ? info.last.get() : nullptr;
+                    for(uint64_t i = 0; i < count && (info.ascending || info.descending); ++i){
+                        const unsigned char* block = data + i * datablock::record_size;
+                        if(prev){
+                            const int cmp = datablock::compare_blocks(prev, block);
+                            info.ascending = info.ascending && cmp <= 0;
+                            info.descending = info.descending && cmp > 0;
+                        }
+                        prev = block;
                     }
+                    std::copy(data + (count - 1) * datablock::record_size, data + count * datablock::record_size, info.last.get());
+                    info.scanned += count;
+                }, opts, first_block, first_block + window_blocks).then([&info, first_block, window_blocks]{
+                    // a window shorter than the blocks asked ends the file
+                    info.eof = info.scanned < first_block + window_blocks;
+                });
+            }).then([&info]{
+                if(info.ascending)
+                    return input_order::ascending;
+                return info.descending ? input_order::descending : input_order::unsorted;
+            });
+        }).finally([f]() mutable {
+            return f.close().finally([f]{});
+        });
+    });
+}
+
+seastar::future<> copy_presorted(seastar::sstring root_filename, input_order order, file_utils::reader_options input, const sort_options& opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::copy);
+    seastar::sstring out_filename = root_filename + ".sorted";
+    return seastar::open_file_dma(out_filename, seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([root_filename, order, input, output=opts.output, limit=opts.limit](seastar::file of) {
+        if(order == input_order::ascending){
+            // straight copy by large writes of the first limit blocks
+            return seastar::do_with(std::make_unique<file_utils::block_writer>(std::move(of), 0, output), [root_filename, input, limit](auto& writer) {
+                return file_utils::read_extents_from_file(root_filename, [&writer](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+                    return writer->write(data, count * datablock::record_size);
+                }, input, 0, limit ? limit : file_utils::end_of_file).finally([&writer]{
+                    return writer->close();
+                });
+            });
+        }
+
+        // the extents are read from the end of the file and written reversed in order,
+        // records smaller than a block would make the mirror positions of the extents unaligned.
+        // With a limit only the last limit blocks are read
+        return seastar::async([root_filename, input, output, limit, of]() mutable {
+            std::unique_ptr<file_utils::block_writer> writer = std::make_unique<file_utils::block_writer>(std::move(of), 0, output);
+            seastar::file in;
+            bool in_open = false;
+            auto next = seastar::make_ready_future<seastar::temporary_buffer<unsigned char>>();
+            try {
+                in = seastar::open_file_dma(root_filename, seastar::open_flags::ro).get0();
+                in_open = true;
+                const uint64_t size = in.size().get0();
+                const uint64_t blocks_tot = size / datablock::record_size + (size % datablock::record_size == 0 ? 0 : 1);
+                const uint64_t extent_blocks = std::max<uint64_t>(1, input.extent_size / datablock::record_size);
+                auto reversed = seastar::allocate_aligned_buffer<unsigned char>(extent_blocks * datablock::record_size, block_size);
+                const uint64_t stop = limit ? blocks_tot - std::min(limit, blocks_tot) : 0;
 
-                    return true;
+                auto read_extent = [&in, extent_blocks, stop](uint64_t end){
+                    const uint64_t count = std::min(extent_blocks, end - stop);
+                    return sort_metrics::track_read(in.dma_read<unsigned char>((end - count) * datablock::record_size, count * datablock::record_size));
                 };
+                uint64_t end = blocks_tot;
+                if(end > stop)
+                    next = read_extent(end);
+                while(end > stop){
+                    const uint64_t count = std::min(extent_blocks, end - stop);
+                    auto buf = std::exchange(next, seastar::make_ready_future<seastar::temporary_buffer<unsigned char>>()).get0();
+                    end -= count;
+                    // the next extent is read while this one is reversed and written
+                    if(end > stop)
+                        next = read_extent(end);
+                    for(uint64_t i = 0; i < count; ++i){
+                        // the last block of the file could be not complete
+                        const size_t from = std::min<size_t>(i * datablock::record_size, buf.size());
+                        const size_t to = std::min<size_t>(from + datablock::record_size, buf.size());
+                        unsigned char* dst = reversed.get() + (count - 1 - i) * datablock::record_size;
+                        std::fill(std::copy(buf.get() + from, buf.get() + to, dst), dst + datablock::record_size, 0);
+                    }
+                    writer->write(reversed.get(), count * datablock::record_size).get();
+                }
+                std::exchange(writer, nullptr)->close().get();
+            } catch(...) {
+                // the read ahead and the writes in flight are waited and both files are closed before the error is given back
+                std::exchange(next, seastar::make_ready_future<seastar::temporary_buffer<unsigned char>>())
+                    .handle_exception([](std::exception_ptr){ return seastar::temporary_buffer<unsigned char>(); }).get();
+                if(writer)
+                    writer->close().handle_exception([](std::exception_ptr){}).get();
+                if(in_open)
+                    in.close().handle_exception([](std::exception_ptr){}).get();
+                throw;
+            }
+            in.close().get();
+        });
+    });
+}
+
+size_t read_ahead_window(size_t files_count, size_t memory)
+{
+    // any file needs two windows, the window is aligned to block size and bound to [min_read_ahead, max_read_ahead].
+    // merge_fan_in keeps the files merged together few enough that the min windows fit the memory
+    size_t window = memory / (2 * std::max<size_t>(1, files_count));
+    window = std::min(window, max_read_ahead);
+    window -= window % block_size;
+    return std::max(window, min_read_ahead);
+}
+
+// read-ahead window of the sorted files of the ranges
+static size_t merge_window(const std::vector<run_range>& ranges, const sort_options& opts)
+{
+    // the write-behind buffers and the partitions kept in memory are taken from the memory available for the merge
+    size_t files_count = 0;
+    size_t used_memory = opts.output.buffer_size * (opts.output.max_writes + 1);
+    for(auto& range:ranges){
+        if(range.resident)
+            used_memory += range.resident->capacity() * datablock::record_size;
+        else
+            ++files_count;
+    }
+    const size_t memory = opts.memory ? opts.memory : seastar::memory::stats().free_memory() / 2;
+    const size_t window = opts.read_ahead ? opts.read_ahead : read_ahead_window(files_count, memory > used_memory ? memory - used_memory : 0);
+    std::cout << "merge " << files_count << " files and " << ranges.size() - files_count << " partitions in memory -- read-ahead window "
+              << window / 1024 << " KB" << std::endl;
+    return window;
+}
+
+// Merge operate by reading blocks from the head of any file involved that ware previously sorted by internal sort algo.
+// The head blocks of the files are the leaves of a loser tree (see loser_tree.hh), the winner of the tournament is the min block
+// that is written to the out file, then the next block of the same file replaces it and only its path to the root is replayed.
+// In this way any output block costs O(log k) compares instead of a scan of the k heads.
+// Any file is read by large reads in background (see disk_block_reader).
+// To perform the algo is needed a list of current block index position iniside any file.
+// When the index position of a file reach the end of its range, the file is considered hexausted
+// and it's removed from the tree.
+// The algo stop when all files are hexausted.
+// The merge writes the ranges of the sorted files to the writer, a file_utils::block_writer or a file_utils::stream_writer
+template <typename Writer>
+static seastar::future<> merge_ranges(std::vector<run_range> ranges, size_t window, uint64_t limit, std::unique_ptr<Writer> writer)
+{
+    external_sort_info sort_info;
+    return seastar::do_with(std::move(sort_info), std::move(writer), std::move(ranges),
+                            [window, limit](auto& sort_info, auto &writer, auto& ranges) mutable {
+        // open the files of the set containing sorted blocks
+        // and initialize the blocks_readers.
+        // readers are referenced by their pending reads, the vector must not reallocate.
+        sort_info.blocks_readers.reserve(ranges.size());
+        return seastar::do_for_each(boost::counting_iterator<uint32_t>(0),
+                                    boost::counting_iterator<uint32_t>(ranges.size()),
+                                    [&ranges, &sort_info, window](auto& file_ndx) mutable {
+            if(ranges[file_ndx].resident){
+                const uint64_t end_block = std::min<uint64_t>(ranges[file_ndx].end_block, ranges[file_ndx].resident->size());
+                const uint64_t first_block = std::min(ranges[file_ndx].first_block, end_block);
+                sort_info.blocks_readers.emplace_back(disk_block_reader(ranges[file_ndx].resident, file_ndx, first_block, end_block));
+                return seastar::make_ready_future();
+            }
+            return seastar::open_file_dma(ranges[file_ndx].name, seastar::open_flags::ro)
+            .then([&ranges, &sort_info, file_ndx, window](seastar::file f) mutable {
+                return f.size().then([&ranges, &sort_info, f, file_ndx, window](size_t size) mutable {
+                    if(ranges[file_ndx].format == datablock::spill_format::front_coded){
+                        const uint64_t pages = size / datablock::spill_page_size + (size % datablock::spill_page_size == 0 ? 0 : 1);
+                        sort_info.blocks_readers.emplace_back(
+                            disk_block_reader::front_coded(std::move(f), file_ndx, ranges[file_ndx].end_block, pages, window));
+                        return seastar::make_ready_future();
+                    }
+                    // handle file size not multiple of record size by size%record_size==0
+                    const uint64_t file_blocks = size/datablock::record_size + (size%datablock::record_size==0?0:1);
+                    const uint64_t end_block = std::min(ranges[file_ndx].end_block, file_blocks);
+                    const uint64_t first_block = std::min(ranges[file_ndx].first_block, end_block);
+                    sort_info.blocks_readers.emplace_back(
+                        disk_block_reader(std::move(f), file_ndx, first_block, end_block, window));
+                    return seastar::make_ready_future();
+                });
+            });
+        }).then([&sort_info]{
+            // load the head of every file, then play the first tournament
+            return seastar::parallel_for_each(sort_info.blocks_readers, [](auto& el) {
+                return el.start();
+            }).then([&sort_info]{
+                auto& readers = sort_info.blocks_readers;
+                sort_info.tree.build(readers.size(), cached_block_compare(&readers, &sort_info.full_compares), [&readers](size_t i){
+                    return readers[i].is_hexausted();
+                });
+            });
+        }).then([&sort_info, &writer, limit]() mutable {
+            // merge files sorting element at each step, a limited merge stops after limit blocks
+            return seastar::do_until([&sort_info, limit]{ return sort_info.tree.empty() || (limit && sort_info.merged_blocks == limit); },
+                                     [&sort_info, &writer]() mutable {
+                // the winner of the tournament has the min of the iteration
+                const size_t pos = sort_info.tree.top();
+                auto& el = sort_info.blocks_readers[pos];
 
-                return seastar::do_until(sort_is_done, [&sort_info, &of, &block_ndx]() mutable {
-                    return seastar::do_for_each(sort_info.blocks_readers, [&sort_info, &block_ndx, &of] (auto& el) mutable {
+                // copy to the out file buffers, the write waits only when all the buffers are in flight
+                return writer->write(el.cached_block(), datablock::record_size).then([&sort_info]{
+                    if(++sort_info.merged_blocks * datablock::record_size % (4096*4096) == 0) //report every 4MB
+                        std::cout << sort_info.merged_blocks * datablock::record_size / 1024 / 1024 << " Mbytes has been merged" << std::endl;
+                }).then([&sort_info, &el]{
+                    // replace the winner by the next block of its file or remove it from the tree
+                    return el.next().then([&sort_info, &el]{
                         if(el.is_hexausted())
-                            return seastar::make_ready_future<>();
+                            sort_info.tree.remove();
+                        else
+                            sort_info.tree.replay();
+                    });
+                });
+            });
+        }).then_wrapped([&sort_info, &ranges, &writer](auto merged) mutable {
+            std::exception_ptr error;
+            try {
+                merged.get();
+                std::cout << "merge done -- " << sort_info.tree.compares() << " blocks compares, "
+                          << sort_info.full_compares << " resolved beyond the key prefix" << std::endl;
+                auto& stats = sort_metrics::local_stats();
+                stats.merge_compares += sort_info.tree.compares();
+                for(auto& reader:sort_info.blocks_readers){
+                    if(reader.resident)
+                        continue;
+                    stats.merge_stall += reader.stall;
+                    stats.run_stalls.push_back(sort_metrics::run_stall{ranges[reader.file_index].name, reader.stall});
+                }
+            } catch(...) {
+                error = std::current_exception();
+            }
+            // the readers and the writer are closed whatever the outcome of the merge,
+            // the reads and the writes in flight use their buffers
+            return seastar::parallel_for_each(sort_info.blocks_readers, [](auto& el) {
+                return el.close();
+            }).then_wrapped([&writer, error](auto closed) mutable {
+                try {
+                    closed.get();
+                } catch(...) {
+                    if(!error)
+                        error = std::current_exception();
+                }
+                if(!error){
+                    std::cout << "flush and close output file" << std::endl;
+                    return writer->close();
+                }
+                // the first error is the one given back
+                return writer->close().then_wrapped([error](auto f){
+                    f.ignore_ready_future();
+                    return seastar::make_exception_future<>(error);
+                });
+            });
+        });
+    });
+}
 
-                        return update_cached_block(el).then([&sort_info, &el]() mutable {
-                            auto first = sort_info.current_min_file_index != file_index_uninited ?
-                                         sort_info.blocks_readers[sort_info.current_min_file_index-1].cached_block.get():
-                                         nullptr;
+seastar::future<> merge_runs(std::vector<run_range> ranges, seastar::sstring out_filename, uint64_t out_block, const sort_options& opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::merge);
+    const size_t window = merge_window(ranges, opts);
+    // the out file is created by the caller, blocks are written starting at out_block
+    return seastar::open_file_dma(out_filename, seastar::open_flags::rw)
+    .then([ranges=std::move(ranges), window, out_block, output=opts.output, limit=opts.limit](seastar::file of) mutable {
+        auto writer = std::make_unique<file_utils::block_writer>(std::move(of), out_block * datablock::record_size, output);
+        return merge_ranges(std::move(ranges), window, limit, std::move(writer));
+    });
+}
 
-                            // suppose that current min value is lower than the new value
-                            auto last = el.cached_block.get();
-                            if(!first || !std::lexicographical_compare(first, first + block_size, last, last + block_size))
-                                    sort_info.current_min_file_index = el.file_index;
+seastar::future<> external_sort(seastar::sstring root_filename, int files_count, const sort_options& opts)
+{
+    std::vector<run_info> runs;
+    for(int i = 1; i <= files_count; ++i)
+        runs.push_back(run_info{root_filename + "." + std::to_string(i), 0});
+    return external_sort(std::move(root_filename), std::move(runs), opts);
+}
 
-                            return seastar::make_ready_future();
-                        });
-                    }).then([&sort_info, &of, &block_ndx]{
-                        // current_min_block has the min of the iteration
-                        const int pos = sort_info.current_min_file_index-1;
-                        sort_info.blocks_readers[pos].block_index++;
-
-                        // write to out file
-                        auto wb = sort_info.blocks_readers[pos].cached_block.get();
-                        return of.dma_write(block_ndx++*block_size, wb, block_size).then([&sort_info, &of, &block_ndx, pos](size_t ret){
-                            sort_info.blocks_readers[pos].cached_block.reset();
-                            sort_info.current_min_file_index = file_index_uninited;
-
-                            static int_fast64_t written = 0;
-                            written += ret;
-                            if(written % (4096*4096) == 0) //flush every 4MB
-                            {
-                                std::cout << written/1024/1024 << " Mbytes has been written -- write n." << block_ndx << std::endl;
-                                return of.flush();
-                            }else
-                                return seastar::make_ready_future();
+run_range whole_run(const run_info& run)
+{
+    // the blocks of a front coded file can't be told from its size
+    const bool coded = run.format == datablock::spill_format::front_coded;
+    return run_range{run.name, 0, coded ? run.blocks : file_utils::end_of_file, run.resident, run.format};
+}
+
+// create or truncate the out file of a merge
+static seastar::future<> create_out_file(seastar::sstring out_filename)
+{
+    return seastar::open_file_dma(out_filename, seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([](seastar::file of) mutable {
+        return of.close().finally([of]{});
+    });
+}
+
+size_t merge_fan_in(const sort_options& opts)
+{
+    // any file needs two windows of at least min_read_ahead to keep the disk streaming
+    const size_t memory = opts.memory ? opts.memory : seastar::memory::stats().free_memory() / 2;
+    const size_t output_memory = opts.output.buffer_size * (opts.output.max_writes + 1);
+    size_t fan_in = memory > output_memory ? (memory - output_memory) / (2 * min_read_ahead) : 0;
+    fan_in = std::min(fan_in, max_merge_files);
+    if(opts.max_fan_in)
+        fan_in = std::min(fan_in, opts.max_fan_in);
+    return std::max<size_t>(fan_in, 2);
+}
+
+merge_plan plan_merge(const std::vector<uint64_t>& run_blocks, size_t fan_in)
+{
+    merge_plan plan;
+    plan.fan_in = std::max<size_t>(fan_in, 2);
+    plan.io_blocks = 0;
+
+    std::vector<uint64_t> blocks(run_blocks);
+    while(blocks.size() > plan.fan_in){
+        // the first merge takes the runs left over by full merges, then any merge takes fan_in runs,
+        // so the last pass has exactly fan_in runs (Huffman merge of fan_in trees)
+        const size_t count = plan.steps.empty() ? (blocks.size() - 2) % (plan.fan_in - 1) + 2 : plan.fan_in;
+
+        // merge the smallest window of consecutive runs, so equal blocks keep the order of the runs
+        uint64_t window = std::accumulate(blocks.begin(), blocks.begin() + count, uint64_t(0));
+        uint64_t best_window = window;
+        size_t best = 0;
+        for(size_t first = 1; first + count <= blocks.size(); ++first){
+            window += blocks[first + count - 1] - blocks[first - 1];
+            if(window < best_window){
+                best_window = window;
+                best = first;
+            }
+        }
+
+        plan.steps.push_back(merge_step{best, count, best_window});
+        plan.io_blocks += 2 * best_window;
+        blocks.erase(blocks.begin() + best + 1, blocks.begin() + best + count);
+        blocks[best] = best_window;
+    }
+
+    // last pass
+    plan.io_blocks += 2 * std::accumulate(blocks.begin(), blocks.end(), uint64_t(0));
+    return plan;
+}
+
+seastar::future<std::vector<run_info>> reduce_runs(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts)
+{
+    std::vector<uint64_t> run_blocks;
+    for(auto& run:runs)
+        run_blocks.push_back(run.blocks);
+    merge_plan plan = plan_merge(run_blocks, merge_fan_in(opts));
+
+    std::cout << "merge plan: " << runs.size() << " files, fan-in " << plan.fan_in << ", "
+              << plan.steps.size() << " intermediate merges, expected I/O "
+              << plan.io_blocks * datablock::record_size / 1024 / 1024 << " MB" << std::endl;
+    for(size_t i = 0; i < plan.steps.size(); ++i)
+        std::cout << "  merge " << i + 1 << ": files " << plan.steps[i].first + 1 << "-" << plan.steps[i].first + plan.steps[i].count
+                  << " of the current list, " << plan.steps[i].blocks * datablock::record_size / 1024 / 1024 << " MB" << std::endl;
+
+    return seastar::do_with(std::move(runs), std::move(plan), [root_filename, opts](auto& runs, auto& plan) {
+        return seastar::do_for_each(boost::counting_iterator<size_t>(0),
+                                    boost::counting_iterator<size_t>(plan.steps.size()),
+                                    [&runs, &plan, root_filename, opts](size_t i) {
+            const merge_step step = plan.steps[i];
+            std::vector<run_range> ranges;
+            for(size_t r = step.first; r < step.first + step.count; ++r)
+                ranges.push_back(whole_run(runs[r]));
+
+            seastar::sstring name = root_filename + ".pass." + std::to_string(i + 1);
+            return create_out_file(name).then([ranges=std::move(ranges), name, opts]() mutable {
+                return merge_runs(std::move(ranges), name, 0, opts);
+            }).then([&runs, step, name, opts]{
+                // the merged file replaces the window of sorted files it was made from, a limited merge stops at the limit
+                runs.erase(runs.begin() + step.first + 1, runs.begin() + step.first + step.count);
+                runs[step.first] = run_info{name, opts.limit ? std::min(step.blocks, opts.limit) : step.blocks};
+            });
+        }).then([&runs]{
+            return std::move(runs);
+        });
+    });
+}
+
+seastar::future<> external_sort(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::merge);
+    // create the out file to write the ordered blocks sequence
+    seastar::sstring out_filename = root_filename + ".sorted";
+    return reduce_runs(root_filename, std::move(runs), opts).then([out_filename, opts](std::vector<run_info> runs) {
+        if(runs.size() == 1 && runs[0].resident){
+            // the input fits a partition, it's written by large writes without temporary files
+            std::cout << "write the sorted partition from memory" << std::endl;
+            truncate_partition(*runs[0].resident, opts.limit);
+            return seastar::do_with(std::move(runs[0].resident), [out_filename, opts](auto& arena) {
+                return file_utils::write_blocks(*arena, out_filename, opts.output);
+            });
+        }
+
+        std::vector<run_range> ranges;
+        for(auto& run:runs)
+            ranges.push_back(whole_run(run));
+        return create_out_file(out_filename).then([ranges=std::move(ranges), out_filename, opts]() mutable {
+            return merge_runs(std::move(ranges), out_filename, 0, opts);
+        });
+    });
+}
+
+seastar::future<> external_sort(seastar::sstring root_filename, std::vector<run_info> runs, seastar::pollable_fd& out, const sort_options& opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::merge);
+    return reduce_runs(root_filename, std::move(runs), opts).then([&out, opts](std::vector<run_info> runs) {
+        if(runs.size() == 1 && runs[0].resident){
+            std::cout << "write the sorted partition from memory" << std::endl;
+            truncate_partition(*runs[0].resident, opts.limit);
+            return seastar::do_with(std::move(runs[0].resident), [&out, opts](auto& arena) {
+                return file_utils::write_blocks(*arena, out, opts.output);
+            });
+        }
+
+        std::vector<run_range> ranges;
+        for(auto& run:runs)
+            ranges.push_back(whole_run(run));
+        const size_t window = merge_window(ranges, opts);
+        return merge_ranges(std::move(ranges), window, opts.limit, std::make_unique<file_utils::stream_writer>(out, opts.output.buffer_size));
+    });
+}
+
+// read the block at block_index of the file into buf
+static seastar::future<> read_block(seastar::file f, uint64_t block_index, unsigned char* buf)
+{
+    return sort_metrics::track_read(f.dma_read<unsigned char>(block_index * datablock::record_size, datablock::record_size))
+    .then([buf](seastar::temporary_buffer<unsigned char> data){
+        std::fill(std::copy(data.get(), data.get() + data.size(), buf), buf + datablock::record_size, 0);
+    });
+}
+
+// sample of a sorted file, it stands for weight blocks of the file
+struct run_sample
+{
+    datablock::blocks_ptr block;
+    uint64_t weight;
+};
+
+// Choose shards-1 splitters that divide the blocks of all the sorted files in shards ranges of about the same size.
+// Any file is sampled at evenly spaced positions, samples are sorted and the splitters are the weighted quantiles.
+static seastar::future<std::vector<std::vector<unsigned char>>> choose_splitters(const std::vector<run_info>& runs, unsigned shards)
+{
+    uint64_t total_blocks = 0;
+    for(auto& run:runs)
+        total_blocks += run.blocks;
+    const uint64_t budget = static_cast<uint64_t>(splitter_oversampling) * shards;
+
+    return seastar::do_with(std::vector<run_sample>(), [&runs, shards, total_blocks, budget](auto& samples) {
+        return seastar::do_for_each(runs, [&samples, total_blocks, budget](const run_info& run) {
+            if(!run.blocks)
+                return seastar::make_ready_future<>();
+            const uint64_t count = std::min(run.blocks, std::max<uint64_t>(1, budget * run.blocks / std::max<uint64_t>(total_blocks, 1)));
+            return seastar::open_file_dma(run.name, seastar::open_flags::ro).then([&samples, &run, count](seastar::file f) {
+                return seastar::do_for_each(boost::counting_iterator<uint64_t>(0),
+                                            boost::counting_iterator<uint64_t>(count),
+                                            [&samples, &run, count, f](uint64_t i) mutable {
+                    datablock::blocks_ptr block = seastar::allocate_aligned_buffer<unsigned char>(datablock::record_size, block_size);
+                    auto buf = block.get();
+                    const uint64_t first = run.blocks * i / count;
+                    const uint64_t weight = run.blocks * (i + 1) / count - first;
+                    return read_block(f, first, buf).then([&samples, block=std::move(block), weight]() mutable {
+                        samples.push_back(run_sample{std::move(block), weight});
+                    });
+                }).finally([f]() mutable {
+                    return f.close().finally([f]{});
+                });
+            });
+        }).then([&samples, shards, total_blocks]{
+            std::sort(samples.begin(), samples.end(), [](const run_sample& a, const run_sample& b){
+                return datablock::compare_blocks(a.block.get(), b.block.get()) < 0;
+            });
+            // the splitters are plain copies of the blocks, so they can be copied to any shard
+            std::vector<std::vector<unsigned char>> splitters;
+            uint64_t cumulated = 0;
+            for(auto& sample:samples){
+                cumulated += sample.weight;
+                if(splitters.size() + 1 < shards && cumulated * shards >= total_blocks * (splitters.size() + 1))
+                    splitters.emplace_back(sample.block.get(), sample.block.get() + datablock::record_size);
+            }
+            // a small input could have less splitters than needed, last shards get empty ranges
+            return splitters;
+        });
+    });
+}
+
+// index of the first block of the sorted file that is not lower than splitter
+static seastar::future<uint64_t> lower_bound(seastar::sstring fname, uint64_t blocks, const unsigned char* splitter)
+{
+    return seastar::open_file_dma(fname, seastar::open_flags::ro).then([blocks, splitter](seastar::file f) {
+        datablock::blocks_ptr block = seastar::allocate_aligned_buffer<unsigned char>(datablock::record_size, block_size);
+        return seastar::do_with(std::move(block), uint64_t(0), blocks, [f, splitter](auto& block, auto& low, auto& high) mutable {
+            return seastar::do_until([&low, &high]{ return low == high; }, [f, splitter, &block, &low, &high]() mutable {
+                const uint64_t mid = low + (high - low) / 2;
+                return read_block(f, mid, block.get()).then([splitter, &block, &low, &high, mid]{
+                    if(datablock::compare_blocks(block.get(), splitter) < 0)
+                        low = mid + 1;
+                    else
+                        high = mid;
+                });
+            }).then([&low]{
+                return low;
+            });
+        }).finally([f]() mutable {
+            return f.close().finally([f]{});
+        });
+    });
+}
+
+// start of the range of the shard in any sorted file, the range of a shard ends where the range of the next one starts
+static seastar::future<std::vector<uint64_t>> shard_range_starts(const std::vector<run_info>& runs,
+                                                                 const std::vector<std::vector<unsigned char>>& splitters,
+                                                                 unsigned shard)
+{
+    std::vector<uint64_t> starts(runs.size(), 0);
+    if(shard == 0)
+        return seastar::make_ready_future<std::vector<uint64_t>>(std::move(starts));
+    if(shard > splitters.size()){
+        for(size_t i = 0; i < runs.size(); ++i)
+            starts[i] = runs[i].blocks;
+        return seastar::make_ready_future<std::vector<uint64_t>>(std::move(starts));
+    }
+
+    const unsigned char* splitter = splitters[shard - 1].data();
+    return seastar::do_with(std::move(starts), [&runs, splitter](auto& starts) {
+        return seastar::parallel_for_each(boost::counting_iterator<size_t>(0),
+                                          boost::counting_iterator<size_t>(runs.size()),
+                                          [&runs, &starts, splitter](size_t i) {
+            return lower_bound(runs[i].name, runs[i].blocks, splitter).then([&starts, i](uint64_t start){
+                starts[i] = start;
+            });
+        }).then([&starts]{
+            return std::move(starts);
+        });
+    });
+}
+
+seastar::future<> parallel_external_sort(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts)
+{
+    const unsigned shards = seastar::smp::count;
+    // partitions in memory are read by their shard only, front coded files can't be split by block index,
+    // the shards write at aligned offsets of the out file only when a record is a whole block
+    // and a limited merge has to count the blocks of all the shards
+    const bool local = datablock::record_size != static_cast<size_t>(block_size) || opts.limit ||
+                       std::any_of(runs.begin(), runs.end(), [](const run_info& run){
+        return run.resident || run.format != datablock::spill_format::raw;
+    });
+    if(shards == 1 || local)
+        return external_sort(std::move(root_filename), std::move(runs), opts);
+
+    // the fan-in of any shard is bound by the memory of the shard as well
+    seastar::sstring out_filename = root_filename + ".sorted";
+    return reduce_runs(root_filename, std::move(runs), opts).then([out_filename](std::vector<run_info> runs) {
+        return create_out_file(out_filename).then([runs=std::move(runs)]() mutable {
+            return std::move(runs);
+        });
+    }).then([shards](std::vector<run_info> runs) mutable {
+        return seastar::do_with(std::move(runs), [shards](auto& runs) {
+            return choose_splitters(runs, shards).then([&runs](std::vector<std::vector<unsigned char>> splitters){
+                return std::make_pair(std::move(runs), std::move(splitters));
+            });
+        });
+    }).then([out_filename, opts, shards](std::pair<std::vector<run_info>, std::vector<std::vector<unsigned char>>> plan) {
+        std::cout << "parallel merge of " << plan.first.size() << " files on " << shards << " shards" << std::endl;
+        return seastar::do_with(std::move(plan), [out_filename, opts, shards](auto& plan) {
+            // any shard finds its range in any sorted file and writes its merge at its own offset of the out file,
+            // it gets its own copy of the plan rather than reading the one of this shard
+            return seastar::parallel_for_each(boost::counting_iterator<unsigned>(0),
+                                              boost::counting_iterator<unsigned>(shards),
+                                              [&plan, out_filename, opts, shards](unsigned shard) {
+                return seastar::smp::submit_to(shard, [runs=plan.first, splitters=plan.second, out_filename, opts, shard]() mutable {
+                    sort_options shard_opts = opts;
+                    shard_opts.memory = std::min(opts.memory ? opts.memory : static_cast<size_t>(-1),
+                                                 seastar::memory::stats().free_memory() / 2);
+                    return seastar::do_with(std::move(runs), std::move(splitters), [out_filename, shard_opts, shard](auto& runs, auto& splitters) {
+                        return shard_range_starts(runs, splitters, shard).then([&runs, &splitters, shard](std::vector<uint64_t> starts) {
+                            return shard_range_starts(runs, splitters, shard + 1).then([starts=std::move(starts)](std::vector<uint64_t> ends) mutable {
+                                return std::make_pair(std::move(starts), std::move(ends));
+                            });
+                        }).then([&runs, out_filename, shard_opts](std::pair<std::vector<uint64_t>, std::vector<uint64_t>> range) {
+                            const auto& starts = range.first;
+                            const auto& ends = range.second;
+                            std::vector<run_range> ranges;
+                            uint64_t out_block = 0;
+                            for(size_t i = 0; i < runs.size(); ++i){
+                                out_block += starts[i];
+                                if(ends[i] > starts[i])
+                                    ranges.push_back(run_range{runs[i].name, starts[i], ends[i]});
+                            }
+                            return merge_runs(std::move(ranges), out_filename, out_block, shard_opts);
                         });
                     });
                 });
-            }).then([&of]() mutable{
-                return of.flush().finally([&of]()mutable{
-                    std::cout << "flush and close output file" << std::endl;
-                    of.close();
+            });
+        });
+    });
+}
+
+// Reader of the key records of a sorted file used by the key-pointer merge, it runs in a seastar thread.
+// Records are read by windows as disk_block_reader does, the block a record points to is read
+// from the file to be sorted only when two keys are equal.
+struct key_record_reader
+{
+    key_record_reader(seastar::file&& f, uint64_t records, size_t window):
+        file(std::move(f)),
+        record_index(0),
+        end_record(records),
+        window_records(std::max<uint64_t>(block_size / file_utils::key_record_size,
+                                          window / block_size * block_size / file_utils::key_record_size)),
+        prefetch(seastar::make_ready_future<>()){}
+
+    bool is_hexausted() const {
+        return record_index == end_record;
+    }
+
+    const unsigned char* key() const {
+        return front.data.get() + (record_index - front.first_block) * file_utils::key_record_size;
+    }
+
+    uint64_t source() const {
+        uint64_t source;
+        std::memcpy(&source, key() + file_utils::key_record_key_size, sizeof(source));
+        return source;
+    }
+
+    // the block the head record points to, read once per record
+    const unsigned char* source_block(seastar::file& source_file) {
+        if(!block)
+            block = seastar::allocate_aligned_buffer<unsigned char>(datablock::record_size, block_size);
+        if(!block_loaded){
+            const uint64_t index = source();
+            auto data = sort_metrics::track_read(source_file.dma_read<unsigned char>(index * datablock::record_size, datablock::record_size)).get0();
+            std::fill(std::copy(data.get(), data.get() + data.size(), block.get()), block.get() + datablock::record_size, 0);
+            block_loaded = true;
+        }
+        return block.get();
+    }
+
+    void start() {
+        if(is_hexausted())
+            return;
+        front.data = seastar::allocate_aligned_buffer<unsigned char>(window_records * file_utils::key_record_size, block_size);
+        back.data = seastar::allocate_aligned_buffer<unsigned char>(window_records * file_utils::key_record_size, block_size);
+        read_window(front, 0).get();
+        start_prefetch();
+    }
+
+    void next() {
+        ++record_index;
+        block_loaded = false;
+        if(is_hexausted() || record_index < front.first_block + front.blocks)
+            return;
+        auto loaded = std::move(prefetch);
+        prefetch = seastar::make_ready_future<>();
+        const auto start = sort_metrics::clock_type::now();
+        loaded.get();
+        stall += sort_metrics::clock_type::now() - start;
+        std::swap(front, back);
+        start_prefetch();
+    }
+
+    // wait the prefetch in flight, that writes to the back window, and close the file.
+    // An error of the prefetch is dropped, the merge is over when the reader is closed
+    void close() {
+        std::exchange(prefetch, seastar::make_ready_future<>()).handle_exception([](std::exception_ptr){}).get();
+        file.close().get();
+    }
+
+    seastar::file file;
+    uint64_t record_index;
+    uint64_t end_record;
+    size_t window_records;
+    // windows of records, first_block and blocks count records
+    read_ahead_buffer front;
+    read_ahead_buffer back;
+    seastar::future<> prefetch;
+    datablock::blocks_ptr block;
+    bool block_loaded = false;
+    sort_metrics::clock_type::duration stall = sort_metrics::clock_type::duration::zero();
+
+private:
+    void start_prefetch() {
+        const uint64_t next_record = front.first_block + front.blocks;
+        if(next_record < end_record)
+            prefetch = read_window(back, next_record);
+    }
+
+    seastar::future<> read_window(read_ahead_buffer& buf, uint64_t first_record) {
+        buf.first_block = first_record;
+        buf.blocks = std::min<uint64_t>(window_records, end_record - first_record);
+        // the read is rounded up to block size, the file ends at the last record
+        const size_t len = (buf.blocks * file_utils::key_record_size + block_size - 1) / block_size * block_size;
+        return sort_metrics::track_read(file.dma_read(first_record * file_utils::key_record_size, buf.data.get(), len)).discard_result();
+    }
+};
+
+// compare the head records of two readers by their keys, then by the blocks they point to
+struct key_record_compare
+{
+    key_record_compare(std::vector<key_record_reader>* readers = nullptr, seastar::file* source = nullptr, uint64_t* blocks_reads = nullptr):
+        readers(readers), source(source), blocks_reads(blocks_reads){}
+
+    int operator()(size_t a, size_t b) const {
+        auto& x = (*readers)[a];
+        auto& y = (*readers)[b];
+        const int cmp = datablock::compare_bytes(x.key(), y.key(), file_utils::key_record_key_size);
+        // a key shorter than the record key is all in the record
+        if(cmp != 0 || datablock::active_key_spec().size() <= file_utils::key_record_key_size)
+            return cmp;
+        *blocks_reads += !x.block_loaded + !y.block_loaded;
+        return datablock::compare_keys(x.source_block(*source), y.source_block(*source), file_utils::key_record_key_size);
+    }
+
+    std::vector<key_record_reader>* readers;
+    seastar::file* source;
+    uint64_t* blocks_reads;
+};
+
+seastar::future<> key_pointer_merge(seastar::sstring fname, std::vector<run_info> runs, const sort_options& opts)
+{
+    return seastar::async([fname, runs=std::move(runs), opts]{
+        sort_metrics::set_phase(sort_metrics::phase::merge);
+        const size_t memory = opts.memory ? opts.memory : seastar::memory::stats().free_memory() / 2;
+        const size_t output_memory = opts.output.buffer_size * (opts.output.max_writes + 1);
+        const size_t window = opts.read_ahead ? opts.read_ahead : read_ahead_window(runs.size(), memory > output_memory ? memory - output_memory : 0);
+        std::cout << "key-pointer merge of " << runs.size() << " files -- read-ahead window " << window / 1024 << " KB" << std::endl;
+
+        seastar::file source = seastar::open_file_dma(fname, seastar::open_flags::ro).get0();
+        std::vector<key_record_reader> readers;
+        std::unique_ptr<file_utils::block_writer> writer;
+        uint64_t blocks_reads = 0;
+        uint64_t merged = 0;
+        loser_tree<key_record_compare> tree;
+        try {
+            readers.reserve(runs.size());
+            for(auto& run:runs)
+                readers.emplace_back(seastar::open_file_dma(run.name, seastar::open_flags::ro).get0(), run.blocks, window);
+            for(auto& reader:readers)
+                reader.start();
+
+            tree.build(readers.size(), key_record_compare(&readers, &source, &blocks_reads), [&readers](size_t i){
+                return readers[i].is_hexausted();
+            });
+
+            // the permutation is the index of any block of the file in sorted order
+            const seastar::sstring permutation_name = fname + ".permutation";
+            seastar::file out = seastar::open_file_dma(permutation_name,
+                seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate).get0();
+            writer = std::make_unique<file_utils::block_writer>(std::move(out), 0, opts.output);
+            while(!tree.empty()){
+                auto& reader = readers[tree.top()];
+                const uint64_t index = reader.source();
+                writer->write(reinterpret_cast<const unsigned char*>(&index), sizeof(index)).get();
+                ++merged;
+                reader.next();
+                if(reader.is_hexausted())
+                    tree.remove();
+                else
+                    tree.replay();
+            }
+
+            // the writer pads the last write and cuts the file to the permutation size
+            std::exchange(writer, nullptr)->close().get();
+        } catch(...) {
+            // the prefetches and the writes in flight use the buffers of the readers and of the writer,
+            // they are waited and any file is closed before the error is given back
+            if(writer)
+                writer->close().handle_exception([](std::exception_ptr){}).get();
+            for(auto& reader:readers){
+                try {
+                    reader.close();
+                } catch(...) {
+                }
+            }
+            source.close().handle_exception([](std::exception_ptr){}).get();
+            throw;
+        }
+
+        for(auto& reader:readers)
+            reader.close();
+        source.close().get();
+        auto& stats = sort_metrics::local_stats();
+        stats.merge_compares += tree.compares();
+        for(size_t i = 0; i < readers.size(); ++i){
+            stats.merge_stall += readers[i].stall;
+            stats.run_stalls.push_back(sort_metrics::run_stall{runs[i].name, readers[i].stall});
+        }
+        std::cout << "key-pointer merge done -- " << merged << " blocks, " << tree.compares() << " keys compares, "
+                  << blocks_reads << " blocks read to resolve equal keys" << std::endl;
+    });
+}
+
+seastar::future<> gather_blocks(seastar::sstring fname, const sort_options& opts, file_utils::reader_options input)
+{
+    return seastar::async([fname, opts, input]{
+        sort_metrics::set_phase(sort_metrics::phase::gather);
+        seastar::file source = seastar::open_file_dma(fname, seastar::open_flags::ro).get0();
+        seastar::file permutation = seastar::open_file_dma(fname + ".permutation", seastar::open_flags::ro).get0();
+        const uint64_t blocks = permutation.size().get0() / sizeof(uint64_t);
+        seastar::file out = seastar::open_file_dma(fname + ".sorted",
+            seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate).get0();
+        file_utils::block_writer writer(std::move(out), 0, opts.output);
+
+        // any batch of the permutation is read from the file by source order, adjacent blocks by a single read.
+        // a batch is a whole number of blocks of the permutation, so its reads are aligned
+        const uint64_t indexes_per_block = block_size / sizeof(uint64_t);
+        const uint64_t batch_blocks = std::max<uint64_t>(1, input.extent_size / datablock::record_size / indexes_per_block) * indexes_per_block;
+        auto indexes = seastar::allocate_aligned_buffer<unsigned char>(batch_blocks * sizeof(uint64_t), block_size);
+        auto batch = seastar::allocate_aligned_buffer<unsigned char>(batch_blocks * datablock::record_size, block_size);
+        seastar::semaphore reads(std::max<size_t>(input.queue_depth, 1));
+        uint64_t read_ops = 0;
+
+        for(uint64_t first = 0; first < blocks; first += batch_blocks){
+            const uint64_t count = std::min(batch_blocks, blocks - first);
+            const size_t len = (count * sizeof(uint64_t) + block_size - 1) / block_size * block_size;
+            sort_metrics::track_read(permutation.dma_read(first * sizeof(uint64_t), indexes.get(), len)).get();
+
+            // (source block, position in the batch) by source block
+            std::vector<std::pair<uint64_t, uint32_t>> order(count);
+            for(uint64_t i = 0; i < count; ++i){
+                std::memcpy(&order[i].first, indexes.get() + i * sizeof(uint64_t), sizeof(uint64_t));
+                order[i].second = static_cast<uint32_t>(i);
+            }
+            std::sort(order.begin(), order.end());
+
+            // spans of adjacent source blocks
+            std::vector<std::pair<size_t, size_t>> spans;
+            for(size_t i = 0; i < order.size(); ){
+                size_t j = i + 1;
+                while(j < order.size() && j - i < max_gather_span && order[j].first == order[j - 1].first + 1)
+                    ++j;
+                spans.emplace_back(i, j);
+                i = j;
+            }
+            read_ops += spans.size();
+
+            seastar::parallel_for_each(spans, [&](const std::pair<size_t, size_t>& span) {
+                return seastar::with_semaphore(reads, 1, [&source, &order, &batch, span]{
+                    const size_t n = span.second - span.first;
+                    // records smaller than a block start anywhere, the read is aligned by seastar
+                    return sort_metrics::track_read(source.dma_read<unsigned char>(order[span.first].first * datablock::record_size, n * datablock::record_size))
+                    .then([&order, &batch, span, n](seastar::temporary_buffer<unsigned char> buf){
+                        for(size_t k = 0; k < n; ++k){
+                            unsigned char* dst = batch.get() + static_cast<size_t>(order[span.first + k].second) * datablock::record_size;
+                            const size_t from = std::min<size_t>(k * datablock::record_size, buf.size());
+                            const size_t to = std::min<size_t>(from + datablock::record_size, buf.size());
+                            std::fill(std::copy(buf.get() + from, buf.get() + to, dst), dst + datablock::record_size, 0);
+                        }
+                    });
+                });
+            }).get();
+            writer.write(batch.get(), count * datablock::record_size).get();
+        }
+
+        writer.close().get();
+        permutation.close().get();
+        source.close().get();
+        std::cout << "gather done -- " << blocks << " blocks by " << read_ops << " reads" << std::endl;
+    });
+}
+
+// Order independent hash of a multiset of blocks: the sum of two independent 64 bits hashes of any block,
+// so two multisets have the same hash whatever the order of their blocks.
+struct multiset_hash
+{
+    uint64_t count = 0;
+    uint64_t sum1 = 0;
+    uint64_t sum2 = 0;
+
+    void add(const unsigned char* block) {
+        uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ datablock::record_size;
+        uint64_t h2 = 0xc2b2ae3d27d4eb4fULL;
+        for(size_t i = 0; i < datablock::record_size; i += sizeof(uint64_t)){
+            uint64_t word;
+            std::memcpy(&word, block + i, sizeof(word));
+            h1 = (h1 ^ word) * 0xff51afd7ed558ccdULL;
+            h1 ^= h1 >> 29;
+            h2 = (h2 + word) * 0xc4ceb9fe1a85ec53ULL;
+            h2 = (h2 << 31) | (h2 >> 33);
+        }
+        ++count;
+        sum1 += mix(h1);
+        sum2 += mix(h2 ^ h1);
+    }
+
+    void merge(const multiset_hash& other) {
+        count += other.count;
+        sum1 += other.sum1;
+        sum2 += other.sum2;
+    }
+
+    bool operator==(const multiset_hash& other) const {
+        return count == other.count && sum1 == other.sum1 && sum2 == other.sum2;
+    }
+
+private:
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+        x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+        return x ^ (x >> 33);
+    }
+};
+
+// verify of a range of the files
+struct verify_range_result
+{
+    multiset_hash input;
+    multiset_hash output;
+    uint64_t first_unsorted = file_utils::end_of_file;
+    // first and last blocks of the output range
+    std::vector<unsigned char> first;
+    std::vector<unsigned char> last;
+};
+
+// blocks [first, last) of the range out of ranges of blocks_tot blocks
+static std::pair<uint64_t, uint64_t> shard_range(uint64_t blocks_tot, unsigned range, unsigned ranges)
+{
+    return std::make_pair(blocks_tot * range / ranges, blocks_tot * (range + 1) / ranges);
+}
+
+static seastar::future<verify_range_result> verify_range(seastar::sstring fname, seastar::sstring out_filename, uint64_t input_blocks,
+                                                         uint64_t output_blocks, unsigned range, unsigned ranges, file_utils::reader_options opts)
+{
+    sort_metrics::set_phase(sort_metrics::phase::verify);
+    const auto input_range = shard_range(input_blocks, range, ranges);
+    const auto output_range = shard_range(output_blocks, range, ranges);
+    return seastar::do_with(verify_range_result(), [fname, out_filename, input_range, output_range, opts](auto& result) {
+        // both files are read together, the input is hashed only
+        auto input = file_utils::read_extents_from_file(fname, [&result](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+            for(uint64_t i = 0; i < count; ++i)
+                result.input.add(data + i * datablock::record_size);
+        }, opts, input_range.first, input_range.second);
+
+        const uint64_t out_first = output_range.first;
+        auto output = file_utils::read_extents_from_file(out_filename, [&result, out_first](const unsigned char* data, uint64_t count, uint64_t first, uint64_t blocks_tot){
+            const unsigned char* prev = result.last.empty() ? nullptr : result.last.data();
+            for(uint64_t i = 0; i < count; ++i){
+                const unsigned char* block = data + i * datablock::record_size;
+                if(!prev)
+                    result.first.assign(block, block + datablock::record_size);
+                else if(result.first_unsorted == file_utils::end_of_file && datablock::compare_blocks(prev, block) > 0)
+                    result.first_unsorted = out_first + first + i;
+                result.output.add(block);
+                prev = block;
+            }
+            if(count)
+                result.last.assign(prev, prev + datablock::record_size);
+        }, opts, output_range.first, output_range.second);
+
+        return seastar::when_all_succeed(std::move(input), std::move(output)).then([&result]{
+            return std::move(result);
+        });
+    });
+}
+
+seastar::future<verify_result> verify_sorted(seastar::sstring fname, seastar::sstring out_filename, file_utils::reader_options opts, unsigned ranges)
+{
+    return seastar::file_size(fname).then([out_filename](uint64_t input_size) {
+        return seastar::file_size(out_filename).then([input_size](uint64_t output_size) {
+            return std::make_pair(input_size, output_size);
+        });
+    }).then([fname, out_filename, opts, ranges](std::pair<uint64_t, uint64_t> sizes) {
+        const uint64_t input_size = sizes.first;
+        const uint64_t output_size = sizes.second;
+        const uint64_t input_blocks = input_size / datablock::record_size + (input_size % datablock::record_size == 0 ? 0 : 1);
+        const uint64_t output_blocks = output_size / datablock::record_size + (output_size % datablock::record_size == 0 ? 0 : 1);
+        const unsigned shards = ranges ? ranges : seastar::smp::count;
+        return seastar::do_with(std::vector<verify_range_result>(shards), [fname, out_filename, opts, input_blocks, output_blocks, shards](auto& ranges) {
+            return seastar::parallel_for_each(boost::counting_iterator<unsigned>(0),
+                                              boost::counting_iterator<unsigned>(shards),
+                                              [fname, out_filename, opts, input_blocks, output_blocks, shards, &ranges](unsigned shard) {
+                return seastar::smp::submit_to(shard % seastar::smp::count, [fname, out_filename, opts, input_blocks, output_blocks, shard, shards]{
+                    return verify_range(fname, out_filename, input_blocks, output_blocks, shard, shards, opts);
+                }).then([&ranges, shard](verify_range_result range){
+                    ranges[shard] = std::move(range);
                 });
+            }).then([&ranges, input_blocks, output_blocks, shards]{
+                verify_result result;
+                result.input_blocks = input_blocks;
+                result.output_blocks = output_blocks;
+                multiset_hash input;
+                multiset_hash output;
+                const std::vector<unsigned char>* prev = nullptr;
+                for(unsigned shard = 0; shard < shards; ++shard){
+                    const auto& range = ranges[shard];
+                    input.merge(range.input);
+                    output.merge(range.output);
+                    if(range.first.empty())
+                        continue;
+                    // the first unsorted block is the first one of the range or one inside it
+                    if(result.sorted() && prev && datablock::compare_blocks(prev->data(), range.first.data()) > 0)
+                        result.first_unsorted = shard_range(output_blocks, shard, shards).first;
+                    if(result.sorted())
+                        result.first_unsorted = range.first_unsorted;
+                    prev = &range.last;
+                }
+                result.permutation = input == output;
+                return result;
             });
         });
     });
 }
 
-} // end namescpace sort algo
\ No newline at end of file
+} // end namescpace sort algo
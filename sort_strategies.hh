@@ -24,9 +24,223 @@
 #include <seastar/core/sstring.hh>
 #include <seastar/core/future.hh>
 #include "block.hh"
+#include "block_writer.hh"
+#include "file_utils.hh"
+#include "front_coding.hh"
+#include <memory>
+#include <vector>
 
 namespace sort_algorithm {
 
-seastar::future<> external_sort(seastar::sstring root_filename, int files_count);
+// read-ahead window bounds of any sorted file read by the merge
+const size_t min_read_ahead(1024*1024);
+const size_t max_read_ahead(8*1024*1024);
+
+struct sort_options
+{
+    // memory available for the merge buffers, 0 means half of the free memory
+    size_t memory = 0;
+    // read-ahead window of any sorted file, 0 means adapt it to memory and files count
+    size_t read_ahead = 0;
+    // max number of files merged together, 0 means bound it by memory only
+    size_t max_fan_in = 0;
+    // write-behind buffers of the sorted file
+    file_utils::writer_options output;
+    // stop the merges after limit blocks, 0 merges all the blocks
+    uint64_t limit = 0;
+};
+
+// sorted file produced by the internal sort
+struct run_info
+{
+    seastar::sstring name;
+    uint64_t blocks;
+    // sorted partition kept in memory instead of being written to the file name, see run_options::keep_last
+    std::shared_ptr<datablock::block_arena> resident = nullptr;
+    datablock::spill_format format = datablock::spill_format::raw;
+};
+
+// blocks [first_block, end_block) of a sorted file, a front coded file is read from its first block
+struct run_range
+{
+    seastar::sstring name;
+    uint64_t first_block;
+    uint64_t end_block;
+    std::shared_ptr<datablock::block_arena> resident = nullptr;
+    datablock::spill_format format = datablock::spill_format::raw;
+};
+
+// range of all the blocks of the sorted file
+run_range whole_run(const run_info& run);
+
+// how the sorted files are generated
+enum class run_generator
+{
+    // sort partitions as large as the memory
+    partition,
+    // stream the blocks through a heap as large as the memory, runs are longer than the memory
+    replacement
+};
+
+struct run_options
+{
+    // memory available for the partitions of any shard
+    size_t memory = 0;
+    // partitions sharing memory, a partition is read while the others are sorted and written
+    size_t partitions = 2;
+    datablock::sort_mode mode = datablock::sort_mode::prefix;
+    run_generator generator = run_generator::partition;
+    // keep the last partition in memory instead of writing it, the merge reads it from memory.
+    // It's honored only when the sorted files are merged on the same shard.
+    bool keep_last = false;
+    // format of the sorted files, a partition is written raw when front coding saves less than max_spill_ratio of its size
+    datablock::spill_format spill = datablock::spill_format::raw;
+    double max_spill_ratio = 0.8;
+    // write the sorted partitions as key records (see file_utils::write_key_records) instead of blocks,
+    // the sorted files are merged by key_pointer_merge
+    bool key_pointer = false;
+    // Keep only the first limit blocks of the sorted order of the range, 0 keeps all the blocks.
+    // When limit blocks fit opts.memory the blocks stream through a bounded heap of the limit smallest blocks
+    // and a single sorted file is written, otherwise any sorted file is truncated at limit blocks
+    uint64_t limit = 0;
+    file_utils::reader_options input;
+    file_utils::writer_options output;
+};
+
+// Sort the blocks [first_block, last_block) of the file in partitions of opts.memory/opts.partitions bytes,
+// any partition is written to a sorted file named run_prefix.N.
+// Read, sort and write are pipelined: a partition is read while the previous ones are sorted and written.
+// With run_generator::replacement the sorted files are made by replacement selection instead, using all opts.memory.
+// Returns the sorted files in input order.
+seastar::future<std::vector<run_info>> internal_sort(seastar::sstring fname, uint64_t first_block, uint64_t last_block,
+                                                     seastar::sstring run_prefix, run_options opts);
+
+// Split the file in a range of blocks for any shard and run internal_sort on all shards,
+// opts.memory is the memory of all the shards.
+// A file that fits the memory of a shard is sorted by the calling shard only.
+// Returns the sorted files of all the shards in input order.
+seastar::future<std::vector<run_info>> parallel_internal_sort(seastar::sstring fname, run_options opts);
+
+// Sort the blocks read from the stream in, a pipe or a socket of unknown length, as internal_sort does: the blocks fill
+// partitions of opts.memory/opts.partitions bytes and any partition is sorted and written to run_prefix.N as soon as it's full.
+// The stream is read by this shard only, a trailing partial block is padded by zeros.
+// When opts.limit blocks fit opts.memory the stream goes through a bounded heap instead, as in internal_sort,
+// and a single sorted file of the first limit blocks is written.
+// Key-pointer sorted files point to the blocks of a file and the sorted files are always made of partitions,
+// so opts.key_pointer throws std::invalid_argument and opts.generator is ignored.
+seastar::future<std::vector<run_info>> stream_internal_sort(seastar::pollable_fd& in, seastar::sstring run_prefix, run_options opts);
+
+// order of the whole input
+enum class input_order
+{
+    unsorted,
+    // non decreasing blocks
+    ascending,
+    // strictly decreasing blocks
+    descending
+};
+
+// Scan the file comparing adjacent blocks. The file is read by windows of opts.queue_depth extents in flight
+// and the scan stops at the end of the window where the file is found unsorted,
+// so it reads the whole file only when the file is presorted.
+seastar::future<input_order> scan_input_order(seastar::sstring fname, file_utils::reader_options opts = file_utils::reader_options());
+
+// Write root_filename.sorted from a presorted file: a straight copy when ascending, a copy in reverse order of the blocks when descending.
+// opts.limit copies the first limit blocks of the sorted order only.
+seastar::future<> copy_presorted(seastar::sstring root_filename, input_order order, file_utils::reader_options input = file_utils::reader_options(),
+                                 const sort_options& opts = sort_options());
+
+// size of the read-ahead window of any of files_count sorted files
+// that are merged together using memory bytes, from min_read_ahead to max_read_ahead.
+size_t read_ahead_window(size_t files_count, size_t memory);
+
+// max number of files opened by a merge
+const size_t max_merge_files(1024);
+
+// number of files merged together: any file gets two windows of min_read_ahead, capped by max_merge_files and opts.max_fan_in.
+// The disk isn't probed: min_read_ahead stands for the read size that keeps a disk streaming between seeks,
+// a device that needs larger reads to stream is given a lower opts.max_fan_in.
+size_t merge_fan_in(const sort_options& opts);
+
+// intermediate merge of count consecutive files of the current list, starting at first
+struct merge_step
+{
+    size_t first;
+    size_t count;
+    uint64_t blocks;
+};
+
+struct merge_plan
+{
+    size_t fan_in;
+    std::vector<merge_step> steps;
+    // blocks read and written by all the passes, the last one included
+    uint64_t io_blocks;
+};
+
+// Plan the intermediate merges that bring the sorted files down to fan_in, the sizes of the sorted files are in blocks.
+// Any merge takes the smallest window of consecutive files, so the merge stays stable.
+merge_plan plan_merge(const std::vector<uint64_t>& run_blocks, size_t fan_in);
+
+// Run the intermediate merges of the plan for the sorted files, the merged files are named root_filename.pass.N.
+// Returns at most merge_fan_in(opts) sorted files in input order.
+seastar::future<std::vector<run_info>> reduce_runs(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts);
+
+// Merge the ranges of the sorted files writing the result to the existing file out_filename starting at out_block.
+seastar::future<> merge_runs(std::vector<run_range> ranges, seastar::sstring out_filename, uint64_t out_block, const sort_options& opts);
+
+// merge the sorted files root_filename.1 ... root_filename.files_count into root_filename.sorted
+seastar::future<> external_sort(seastar::sstring root_filename, int files_count, const sort_options& opts = sort_options());
+
+// merge the sorted files into root_filename.sorted
+seastar::future<> external_sort(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts = sort_options());
+
+// merge the sorted files into the stream out, a pipe or a socket, instead of root_filename.sorted.
+// The intermediate merges are still written to root_filename.pass.N
+seastar::future<> external_sort(seastar::sstring root_filename, std::vector<run_info> runs, seastar::pollable_fd& out,
+                                const sort_options& opts = sort_options());
+
+// Merge the key-pointer sorted files of fname (see run_options::key_pointer) into fname.permutation,
+// the index of any block of fname in sorted order as uint64_t in host byte order.
+// Keys are compared first, equal keys are resolved by reading the blocks of fname they point to.
+seastar::future<> key_pointer_merge(seastar::sstring fname, std::vector<run_info> runs, const sort_options& opts = sort_options());
+
+// max number of adjacent blocks read together by gather_blocks
+const size_t max_gather_span(64);
+
+// Write fname.sorted copying the blocks of fname in the order of fname.permutation.
+// The permutation is read by batches of input.extent_size bytes of blocks, the blocks of a batch are read in file order.
+seastar::future<> gather_blocks(seastar::sstring fname, const sort_options& opts = sort_options(),
+                                file_utils::reader_options input = file_utils::reader_options());
+
+// samples per shard used to choose the splitters of the parallel merge
+const unsigned splitter_oversampling(32);
+
+// Merge the sorted files into root_filename.sorted on all shards.
+// Sorted files are sampled to choose a splitter block for any shard, then any shard finds by binary search
+// the range of its keys in any sorted file, merges them and writes the result at its offset of the out file.
+// The blocks of any sorted file must be known. Opts.memory is the memory of any shard.
+seastar::future<> parallel_external_sort(seastar::sstring root_filename, std::vector<run_info> runs, const sort_options& opts = sort_options());
+
+// result of verify_sorted
+struct verify_result
+{
+    uint64_t input_blocks = 0;
+    uint64_t output_blocks = 0;
+    // index of the first block of the output smaller than the previous one, end_of_file when the output is sorted
+    uint64_t first_unsorted = file_utils::end_of_file;
+    // the multiset hashes of the input and of the output blocks are equal
+    bool permutation = false;
+
+    bool sorted() const { return first_unsorted == file_utils::end_of_file; }
+    bool ok() const { return sorted() && permutation; }
+};
+
+// Verify that out_filename is sorted by the active key and is a permutation of fname without sorting anything.
+// Both files are split in ranges, a range per shard when ranges is 0, and range i is verified by shard i % smp::count.
+// Any range of both files is read once: the order of its output blocks is checked and an order independent hash
+// of the blocks of both ranges is summed, then the last block of any output range is compared with the first one of the next.
+seastar::future<verify_result> verify_sorted(seastar::sstring fname, seastar::sstring out_filename,
+                                             file_utils::reader_options opts = file_utils::reader_options(), unsigned ranges = 0);
 
 }
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <seastar/core/app-template.hh>
+#include <seastar/core/reactor.hh>
+#include <seastar/core/file.hh>
+#include <seastar/core/smp.hh>
+#include <seastar/core/thread.hh>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include "workload.hh"
+#include "../sort_strategies.hh"
+#include "../file_utils.hh"
+#include "../block.hh"
+#include "../sort_metrics.hh"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static double mb_per_s(uint64_t bytes, double seconds)
+{
+    return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+static void report(const char* name, uint64_t bytes, double seconds)
+{
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << seconds << " s " << std::setprecision(1) << std::setw(10) << mb_per_s(bytes, seconds) << " MB/s" << std::endl;
+}
+
+// restore the input order of the arena, the slots hold the records in generation order
+static void reset_order(datablock::block_arena& arena, size_t records)
+{
+    auto& order = arena.order();
+    order.resize(records);
+    std::iota(order.begin(), order.end(), 0);
+}
+
+// ns per compare of compare over random pairs of the arena records
+template <typename Compare>
+static void bench_compare(const char* name, const datablock::block_arena& arena, size_t records, uint64_t seed, Compare compare)
+{
+    const size_t pairs = 1024*1024;
+    std::mt19937_64 rng(seed);
+    std::vector<std::pair<uint32_t, uint32_t>> indexes(pairs);
+    for(auto& p:indexes)
+        p = std::make_pair(static_cast<uint32_t>(rng() % records), static_cast<uint32_t>(rng() % records));
+
+    volatile int sink = 0;
+    const auto start = bench_clock::now();
+    for(const auto& p:indexes)
+        sink += compare(arena.slot(p.first), arena.slot(p.second)) < 0;
+    const double elapsed = seconds_since(start);
+    (void)sink;
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << elapsed * 1e9 / pairs << " ns/compare" << std::endl;
+}
+
+// microbenchmarks of the comparator, of sort_blocks in any mode, of the sorted files writes and of the merge
+static void run_microbenchmarks(seastar::sstring fname, const workload::workload_options& opts, uint64_t records, unsigned iterations)
+{
+    const uint64_t bytes = records * datablock::record_size;
+    datablock::block_arena arena(records);
+    {
+        const workload::record_generator generator(opts);
+        std::vector<unsigned char> buffer(datablock::record_size);
+        for(uint64_t i = 0; i < records; ++i){
+            generator.fill(i, 1, buffer.data());
+            arena.push_back(buffer.data());
+        }
+    }
+    std::cout << "microbenchmarks on " << records << " records -- " << bytes / 1024 / 1024 << " MB" << std::endl;
+
+    bench_compare("compare_bytes", arena, records, opts.seed, [](const unsigned char* a, const unsigned char* b){
+        return datablock::compare_bytes(a, b, datablock::record_size);
+    });
+    bench_compare(datablock::record_compare_name(), arena, records, opts.seed, datablock::record_compare);
+    bench_compare("compare_blocks (key)", arena, records, opts.seed, [](const unsigned char* a, const unsigned char* b){
+        return datablock::compare_blocks(a, b);
+    });
+
+    const std::pair<const char*, datablock::sort_mode> modes[] = {
+        {"sort_blocks stable", datablock::sort_mode::stable},
+        {"sort_blocks prefix", datablock::sort_mode::prefix},
+        {"sort_blocks radix", datablock::sort_mode::radix}
+    };
+    for(const auto& mode:modes){
+        double best = 0;
+        for(unsigned i = 0; i < iterations; ++i){
+            reset_order(arena, records);
+            const auto start = bench_clock::now();
+            datablock::sort_blocks(arena, mode.second);
+            const double elapsed = seconds_since(start);
+            best = i == 0 ? elapsed : std::min(best, elapsed);
+        }
+        report(mode.first, bytes, best);
+    }
+
+    // the sorted arena is written in run_count sorted files that are merged back
+    const size_t run_count = 8;
+    const uint64_t run_records = (records + run_count - 1) / run_count;
+    std::vector<sort_algorithm::run_range> ranges;
+    double write_time = 0;
+    for(size_t r = 0; r * run_records < records; ++r){
+        const uint64_t first = r * run_records;
+        const uint64_t count = std::min(run_records, records - first);
+        datablock::block_arena run(count);
+        for(uint64_t i = first; i < first + count; ++i)
+            run.push_back(arena.slot(static_cast<uint32_t>(i)));
+        datablock::sort_blocks(run);
+        const seastar::sstring run_name = fname + ".bench." + seastar::to_sstring(r);
+        const auto start = bench_clock::now();
+        file_utils::write_blocks(run, run_name).get();
+        write_time += seconds_since(start);
+        ranges.push_back(sort_algorithm::run_range{run_name, 0, count});
+    }
+    report("write sorted files", bytes, write_time);
+
+    const seastar::sstring merged_name = fname + ".bench.merged";
+    seastar::open_file_dma(merged_name, seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate).get0().close().get();
+    const auto merge_start = bench_clock::now();
+    sort_algorithm::merge_runs(ranges, merged_name, 0, sort_algorithm::sort_options()).get();
+    report("merge_runs", bytes, seconds_since(merge_start));
+
+    for(const auto& range:ranges)
+        seastar::remove_file(range.name).get();
+    seastar::remove_file(merged_name).get();
+}
+
+// bytes read and written by any phase on all the shards
+static std::array<sort_metrics::phase_counters, sort_metrics::phases_count> phase_bytes()
+{
+    std::array<sort_metrics::phase_counters, sort_metrics::phases_count> total{};
+    for(unsigned shard = 0; shard < seastar::smp::count; ++shard){
+        const auto counters = seastar::smp::submit_to(shard, []{
+            return sort_metrics::local_stats().phases;
+        }).get0();
+        for(size_t p = 0; p < sort_metrics::phases_count; ++p){
+            total[p].bytes_read += counters[p].bytes_read;
+            total[p].bytes_written += counters[p].bytes_written;
+        }
+    }
+    return total;
+}
+
+// sort the workload file as bigsort does and report the MB/s of any phase
+static void run_end_to_end(seastar::sstring fname, uint64_t bytes, sort_algorithm::run_options run_opts, sort_algorithm::sort_options sort_opts)
+{
+    const auto before = phase_bytes();
+    const auto start = bench_clock::now();
+
+    auto phase_start = bench_clock::now();
+    const auto order = sort_algorithm::scan_input_order(fname, run_opts.input).get0();
+    const double scan_time = seconds_since(phase_start);
+
+    double runs_time = 0;
+    double merge_time = 0;
+    double copy_time = 0;
+    if(order != sort_algorithm::input_order::unsorted){
+        phase_start = bench_clock::now();
+        sort_algorithm::copy_presorted(fname, order, run_opts.input, sort_opts).get();
+        copy_time = seconds_since(phase_start);
+    }else{
+        phase_start = bench_clock::now();
+        auto runs = sort_algorithm::parallel_internal_sort(fname, run_opts).get0();
+        runs_time = seconds_since(phase_start);
+        std::cout << runs.size() << " sorted files" << std::endl;
+        phase_start = bench_clock::now();
+        sort_algorithm::parallel_external_sort(fname, std::move(runs), sort_opts).get();
+        merge_time = seconds_since(phase_start);
+    }
+    const double total_time = seconds_since(start);
+    const auto after = phase_bytes();
+
+    std::cout << "end to end sort of " << bytes / 1024 / 1024 << " MB" << std::endl;
+    const std::pair<sort_metrics::phase, double> phases[] = {
+        {sort_metrics::phase::scan, scan_time},
+        {sort_metrics::phase::runs, runs_time},
+        {sort_metrics::phase::merge, merge_time},
+        {sort_metrics::phase::copy, copy_time}
+    };
+    for(const auto& p:phases){
+        const size_t index = static_cast<size_t>(p.first);
+        const uint64_t read = after[index].bytes_read - before[index].bytes_read;
+        const uint64_t written = after[index].bytes_written - before[index].bytes_written;
+        if(p.second == 0 && read == 0 && written == 0)
+            continue;
+        report(sort_metrics::phase_name(p.first), bytes, p.second);
+        std::cout << "    read " << std::setprecision(1) << mb_per_s(read, p.second) << " MB/s -- written "
+                  << mb_per_s(written, p.second) << " MB/s" << std::endl;
+    }
+    report("total", bytes, total_time);
+}
+
+int main(int argc, char** argv) {
+    namespace bpo = boost::program_options;
+    seastar::app_template app;
+    app.add_options()
+        ("workload", bpo::value<seastar::sstring>()->default_value("uniform"), "Distribution of the records: uniform, zipf, duplicates, common-prefix, nearly-sorted or interleaved-runs")
+        ("size", bpo::value<uint64_t>()->default_value(256), "Size of the workload expressed in MB")
+        ("seed", bpo::value<uint64_t>()->default_value(1), "Seed of the workload, the same seed generates the same file")
+        ("record-size", bpo::value<size_t>()->default_value(4096), "Size of the records in bytes, a power of two from 8 to 4096")
+        ("skew", bpo::value<double>()->default_value(1.0), "Exponent of the Zipf law of the zipf workload")
+        ("distinct-keys", bpo::value<uint64_t>()->default_value(1024), "Distinct keys of the zipf workload, distinct records of the duplicates workload")
+        ("prefix-length", bpo::value<size_t>()->default_value(64), "Bytes shared by all the records of the common-prefix workload")
+        ("disorder", bpo::value<double>()->default_value(0.01), "Fraction of the records out of place in the nearly-sorted workload")
+        ("runs", bpo::value<size_t>()->default_value(16), "Ascending sequences of the interleaved-runs workload")
+        ("micro", bpo::value<bool>()->default_value(true), "Run the microbenchmarks")
+        ("micro-size", bpo::value<uint64_t>()->default_value(64), "Size of the in memory sample of the microbenchmarks expressed in MB")
+        ("iterations", bpo::value<unsigned>()->default_value(3), "Iterations of any sort microbenchmark, the best one is reported")
+        ("end-to-end", bpo::value<bool>()->default_value(true), "Sort the workload file and report the MB/s of any phase")
+        ("mem", bpo::value<size_t>()->default_value(64), "Memory available for internal sort expressed in MB")
+        ("sort", bpo::value<seastar::sstring>()->default_value("prefix"), "Internal sort algorithm of the end to end sort: stable, prefix or radix");
+    app.add_positional_options({
+       { "filename", bpo::value<seastar::sstring>(),
+         "workload file, it's sorted to filename.sorted", -1}
+    });
+
+    int exit_code = 0;
+    const int ret = app.run(argc, argv, [&app, &exit_code]{
+        auto& args = app.configuration();
+        if (!args.count("filename")){
+            std::cout << "benchmark filename" << '\n';
+            return seastar::make_ready_future<>();
+        }
+
+        return seastar::async([&args]{
+            const seastar::sstring fname = args["filename"].as<seastar::sstring>();
+            datablock::set_record_size(args["record-size"].as<size_t>());
+
+            workload::workload_options opts;
+            opts.dist = workload::parse_distribution(args["workload"].as<seastar::sstring>());
+            opts.seed = args["seed"].as<uint64_t>();
+            opts.skew = args["skew"].as<double>();
+            opts.distinct_keys = args["distinct-keys"].as<uint64_t>();
+            opts.prefix_length = args["prefix-length"].as<size_t>();
+            opts.disorder = args["disorder"].as<double>();
+            opts.runs = args["runs"].as<size_t>();
+            // the sort algorithm is checked before the workload is generated
+            sort_algorithm::run_options run_opts;
+            const seastar::sstring sort = args["sort"].as<seastar::sstring>();
+            if(sort == "stable")
+                run_opts.mode = datablock::sort_mode::stable;
+            else if(sort == "radix")
+                run_opts.mode = datablock::sort_mode::radix;
+            else if(sort != "prefix")
+                throw std::invalid_argument("unknown sort algorithm " + sort);
+
+            const uint64_t records = std::max<uint64_t>(args["size"].as<uint64_t>()*1024*1024 / datablock::record_size, 1);
+            const uint64_t bytes = records * datablock::record_size;
+            std::cout << "benchmark of workload " << workload::distribution_name(opts.dist) << " seed " << opts.seed
+                      << " -- " << records << " records of " << datablock::record_size << " bytes on " << seastar::smp::count << " shards"
+                      << "\ncompare kernel " << datablock::active_compare_kernel().name
+                      << " -- record compare kernel " << datablock::record_compare_name() << std::endl;
+
+            if(args["micro"].as<bool>()){
+                const uint64_t micro_records = std::min(records, std::max<uint64_t>(args["micro-size"].as<uint64_t>()*1024*1024 / datablock::record_size, 1));
+                run_microbenchmarks(fname, opts, micro_records, std::max(args["iterations"].as<unsigned>(), 1u));
+            }
+
+            const auto generate_start = bench_clock::now();
+            workload::write_workload(fname, records, opts).get();
+            report("generate", bytes, seconds_since(generate_start));
+
+            if(args["end-to-end"].as<bool>()){
+                run_opts.memory = args["mem"].as<size_t>()*1024*1024;
+                run_opts.keep_last = true;
+                sort_algorithm::sort_options sort_opts;
+                sort_opts.memory = std::min(run_opts.memory / seastar::smp::count, seastar::memory::stats().free_memory()/2);
+                run_end_to_end(fname, bytes, run_opts, sort_opts);
+            }
+        }).handle_exception([&exit_code](std::exception_ptr e) {
+            try {
+                std::rethrow_exception(e);
+            } catch(const std::exception& ex) {
+                std::cout << "Caught exception \"" << ex.what() << "\"\n";
+            }
+            exit_code = 1;
+        });
+    });
+
+    return ret ? ret : exit_code;
+}
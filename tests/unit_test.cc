@@ -26,10 +26,18 @@
 #include <seastar/core/reactor.hh>
 #include <seastar/core/shared_ptr.hh>
 #include <seastar/core/do_with.hh>
+#include <seastar/core/posix.hh>
 #include <iostream>
+#include <random>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
 #include "../sort_strategies.hh"
 #include "../file_utils.hh"
 #include "../block.hh"
+#include "../loser_tree.hh"
+#include "../sort_metrics.hh"
+#include "workload.hh"
 
 const std::string pattern_dir(TEST_PATTERN_DIR);
 
@@ -119,6 +127,28 @@ seastar::future<> write_test_pattern(seastar::sstring fname,
     });
 }
 
+// the file holds the blocks of the sorted test pattern
+seastar::future<> check_sorted_pattern(seastar::sstring sorted_fname) {
+    return read_blocks_from_file(sorted_fname, [](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+        BOOST_REQUIRE(blocks_tot == test_pattern_sorted.size());
+        BOOST_REQUIRE(std::equal(x.get(),x.get() + test_pattern_sorted[block_index].size(), test_pattern_sorted[block_index].begin()));
+    });
+}
+
+// write the unsorted test pattern to fname, sort it by internal_sort and merge the sorted files to fname.sorted,
+// check_runs checks the sorted files before the merge and the merge is checked against the sorted test pattern
+template <typename CheckRuns>
+seastar::future<> sort_test_pattern(seastar::sstring fname, run_options opts, sort_options merge_opts, CheckRuns check_runs) {
+    return write_test_pattern(fname).then([fname, opts]{
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([fname, merge_opts, check_runs](std::vector<run_info> runs){
+        check_runs(runs);
+        return external_sort(fname, std::move(runs), merge_opts);
+    }).then([fname]{
+        return check_sorted_pattern(fname + ".sorted");
+    });
+}
+
 SEASTAR_TEST_CASE( test_internal_sort ) {
     static seastar::sstring fname(pattern_dir  + "/blocks_test_pattern");
     static blocks_vector blocks;
@@ -185,3 +215,940 @@ SEASTAR_TEST_CASE(test_read_blocks_from_file) {
         TEST_HANDLE_EXCEPTION;
     });
 }
+
+// merge test_pattern_sorted_set subsets by the loser tree and check the compares count
+SEASTAR_TEST_CASE(test_loser_tree_merge) {
+    struct head_compare {
+        std::vector<std::vector<seastar::sstring>>* runs;
+        std::vector<size_t>* heads;
+        int operator()(size_t a, size_t b) const {
+            return (*runs)[a][(*heads)[a]].compare((*runs)[b][(*heads)[b]]);
+        }
+    };
+
+    std::vector<std::vector<seastar::sstring>> runs({
+        {test_pattern_sorted_set.begin(), test_pattern_sorted_set.begin() + 4},
+        {test_pattern_sorted_set.begin() + 4, test_pattern_sorted_set.begin() + 8},
+        {},
+        {test_pattern_sorted_set.begin() + 8, test_pattern_sorted_set.end()}});
+    std::vector<size_t> heads(runs.size(), 0);
+
+    loser_tree<head_compare> tree;
+    tree.build(runs.size(), head_compare{&runs, &heads}, [&runs](size_t i){ return runs[i].empty(); });
+
+    std::vector<seastar::sstring> merged;
+    while(!tree.empty()){
+        const size_t w = tree.top();
+        merged.push_back(runs[w][heads[w]]);
+        if(++heads[w] == runs[w].size())
+            tree.remove();
+        else
+            tree.replay();
+    }
+
+    BOOST_REQUIRE(merged == test_pattern_sorted);
+    // at most ceil(log2(k)) compares for each element plus the first tournament
+    BOOST_REQUIRE(tree.compares() <= runs.size() + merged.size() * 2);
+    return seastar::make_ready_future<>();
+}
+
+// read-ahead window is bound by memory, files count and block alignment
+SEASTAR_TEST_CASE(test_read_ahead_window) {
+    BOOST_REQUIRE(read_ahead_window(1, 1024*1024*1024) == max_read_ahead);
+    BOOST_REQUIRE(read_ahead_window(100, 400*1024*1024) == 2*1024*1024);
+    BOOST_REQUIRE(read_ahead_window(1000, 1024*1024) == min_read_ahead);
+    BOOST_REQUIRE(read_ahead_window(3, 1000000) % block_size == 0);
+    return seastar::make_ready_future<>();
+}
+
+// test read_extents_from_file on a file with a trailing partial block, it must be handed padded by zeros
+SEASTAR_TEST_CASE(test_block_writer) {
+    static seastar::sstring fname(pattern_dir  + "/block_writer_test_pattern");
+    // buffers of 2 blocks with 2 writes in flight, 9 blocks make 5 writes the last one of a single block
+    writer_options opts;
+    opts.buffer_size = 2 * block_size;
+    opts.max_writes = 2;
+    const size_t count = 9;
+    auto data = std::make_shared<std::vector<unsigned char>>(count * block_size);
+    for(size_t i = 0; i < data->size(); ++i)
+        (*data)[i] = static_cast<unsigned char>(i / block_size + i % 251);
+    return seastar::open_file_dma(fname, seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate)
+    .then([opts, data](seastar::file f){
+        return seastar::do_with(std::make_unique<block_writer>(std::move(f), 0, opts), [data](auto& writer){
+            return seastar::do_for_each(boost::counting_iterator<size_t>(0),
+                                        boost::counting_iterator<size_t>(count),
+                                        [&writer, data](size_t i){
+                return writer->write(data->data() + i * block_size, block_size);
+            }).then([&writer]{
+                return writer->close();
+            }).then([&writer]{
+                // close resolves once every write is done
+                BOOST_REQUIRE(writer->bytes_written() == count * block_size);
+            });
+        });
+    }).then([data]{
+        return read_blocks_from_file(fname, [data](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == count);
+            BOOST_REQUIRE(std::equal(x.get(), x.get() + block_size, data->begin() + block_index * block_size));
+        });
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_read_extents_partial_block) {
+    static seastar::sstring fname(pattern_dir  + "/test_pattern_partial");
+    static const size_t partial_size = 100;
+    static uint64_t blocks_read = 0;
+    return write_test_pattern(fname).then([]{
+        return seastar::open_file_dma(fname, seastar::open_flags::rw).then([](seastar::file f) mutable {
+            return f.truncate((test_pattern_unsorted.size() - 1) * block_size + partial_size).then([f]() mutable {
+                return f.close().finally([f]{});
+            });
+        });
+    }).then([]{
+        reader_options opts;
+        opts.extent_size = 3 * block_size;
+        opts.queue_depth = 2;
+        return read_extents_from_file(fname, [](const unsigned char* data, uint64_t count, uint64_t first_block, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == test_pattern_unsorted.size());
+            BOOST_REQUIRE(first_block == blocks_read);
+            for(uint64_t i = 0; i < count; ++i){
+                auto x = data + i * block_size;
+                const auto& pattern = test_pattern_unsorted[first_block + i];
+                const size_t valid = first_block + i == blocks_tot - 1 ? std::min(pattern.size(), partial_size) : pattern.size();
+                BOOST_REQUIRE(std::equal(x, x + valid, pattern.begin()));
+                BOOST_REQUIRE(std::all_of(x + pattern.size(), x + block_size, [](unsigned char c){ return c == 0; }));
+            }
+            blocks_read += count;
+        }, opts);
+    }).then([]{
+        BOOST_REQUIRE(blocks_read == test_pattern_unsorted.size());
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+// sort the test pattern stored in a block arena by any sort mode, reusing the arena
+SEASTAR_TEST_CASE(test_arena_sort) {
+    const std::vector<sort_mode> modes({sort_mode::stable, sort_mode::prefix, sort_mode::radix});
+    block_arena arena(test_pattern_unsorted.size());
+    for(auto mode:modes){
+        for(auto &x:test_pattern_unsorted){
+            auto block = make_block(x.begin(), x.end());
+            std::fill(block.get() + x.size(), block.get() + block_size, 0);
+            arena.push_back(block.get());
+        }
+        BOOST_REQUIRE(arena.full());
+        sort_blocks(arena, mode);
+        for(size_t i = 0; i < arena.size(); ++i)
+            BOOST_REQUIRE(std::equal(arena.block(i), arena.block(i) + test_pattern_sorted[i].size(), test_pattern_sorted[i].begin()));
+        // prefixes follow the blocks order
+        for(size_t i = 1; i < arena.size(); ++i)
+            BOOST_REQUIRE(block_prefix(arena.block(i - 1)) <= block_prefix(arena.block(i)));
+        arena.reset();
+        BOOST_REQUIRE(arena.empty());
+    }
+    return seastar::make_ready_future<>();
+}
+
+// a partition of long ascending and descending runs is merged keeping equal blocks in input order
+SEASTAR_TEST_CASE(test_natural_runs) {
+    const size_t run = 4 * natural_run_min_size;
+    block_arena arena(3 * run);
+    std::vector<unsigned char> block(block_size, 0);
+    for(size_t i = 0; i < 3 * run; ++i){
+        // ascending with duplicates, strictly descending, ascending again
+        const size_t key = i < run ? i / 2 : (i < 2 * run ? 3 * run - i : i - 2 * run);
+        block[0] = static_cast<unsigned char>(key);
+        arena.push_back(block.data());
+    }
+    std::vector<uint32_t> expected(arena.order());
+    std::stable_sort(expected.begin(), expected.end(), [&arena](uint32_t a, uint32_t b){
+        return arena.slot(a)[0] < arena.slot(b)[0];
+    });
+
+    sort_blocks(arena, sort_mode::radix);
+    BOOST_REQUIRE(arena.order() == expected);
+    return seastar::make_ready_future<>();
+}
+
+// blocks ordered by a key of two fields, the second one descending, equal keys keep the input order in any mode
+SEASTAR_TEST_CASE(test_key_spec) {
+    const key_spec spec = key_spec::parse("16:2,100:1:desc");
+    BOOST_REQUIRE(spec.size() == 3 && !spec.whole_block() && key_spec::parse("all").whole_block());
+    BOOST_REQUIRE_THROW(key_spec::parse("4090:8"), std::invalid_argument);
+    // a negative number or an offset + length that wraps around is out of the record
+    BOOST_REQUIRE_THROW(key_spec::parse("8:-1"), std::invalid_argument);
+    BOOST_REQUIRE_THROW(key_spec::parse("-1:8"), std::invalid_argument);
+    BOOST_REQUIRE_THROW(key_spec::parse(" -1:8"), std::invalid_argument);
+    BOOST_REQUIRE_THROW(key_spec(std::vector<key_field>({key_field{8, static_cast<size_t>(-1), false}})), std::invalid_argument);
+    BOOST_REQUIRE_THROW(key_spec(std::vector<key_field>({key_field{static_cast<size_t>(-8), 16, false}})), std::invalid_argument);
+
+    return seastar::make_ready_future<>().then([spec]{
+        const size_t count = 500;
+        std::mt19937 gen(16);
+        std::vector<unsigned char> block(block_size);
+        const std::vector<sort_mode> modes({sort_mode::stable, sort_mode::prefix, sort_mode::radix});
+        std::vector<std::unique_ptr<block_arena>> arenas;
+        for(size_t m = 0; m < modes.size(); ++m)
+            arenas.push_back(std::make_unique<block_arena>(count));
+        for(size_t i = 0; i < count; ++i){
+            for(auto& c:block)
+                c = gen() % 3;
+            for(auto& arena:arenas)
+                arena->push_back(block.data());
+        }
+
+        const block_arena& input = *arenas[0];
+        std::vector<uint32_t> expected(input.order());
+        std::stable_sort(expected.begin(), expected.end(), [&input](uint32_t a, uint32_t b){
+            const int cmp = std::memcmp(input.slot(a) + 16, input.slot(b) + 16, 2);
+            if(cmp != 0)
+                return cmp < 0;
+            return input.slot(a)[100] > input.slot(b)[100];
+        });
+
+        set_key_spec(spec);
+        for(size_t m = 0; m < modes.size(); ++m){
+            sort_blocks(*arenas[m], modes[m]);
+            BOOST_REQUIRE(arenas[m]->order() == expected);
+        }
+    }).finally([]{
+        // the next tests sort by the whole block even when this one failed
+        set_key_spec(key_spec());
+    });
+}
+
+// radix sort and stable sort produce the same order on blocks with long common prefixes and duplicates
+SEASTAR_TEST_CASE(test_radix_sort) {
+    const size_t count = 2000;
+    block_arena radix_arena(count);
+    block_arena stable_arena(count);
+    std::mt19937 gen(4096);
+    std::vector<unsigned char> block(block_size);
+    for(size_t i = 0; i < count; ++i){
+        // genbigfile like blocks: a long common prefix and a few different bytes at the end
+        std::fill(block.begin(), block.end(), '0');
+        for(size_t j = block_size - 12; j < static_cast<size_t>(block_size); ++j)
+            block[j] = '0' + gen() % 2;
+        radix_arena.push_back(block.data());
+        stable_arena.push_back(block.data());
+    }
+
+    sort_blocks(radix_arena, sort_mode::radix);
+    sort_blocks(stable_arena, sort_mode::stable);
+    BOOST_REQUIRE(radix_arena.order() == stable_arena.order());
+    return seastar::make_ready_future<>();
+}
+
+// the sort in a seastar thread gives the same order as the sort on the reactor, whatever the mode
+SEASTAR_TEST_CASE(test_async_sort) {
+    const size_t count = 3000;
+    std::mt19937 gen(20);
+    std::vector<unsigned char> block(block_size);
+    auto arenas = std::make_shared<std::vector<std::unique_ptr<block_arena>>>();
+    for(size_t a = 0; a < 6; ++a)
+        arenas->push_back(std::make_unique<block_arena>(count));
+    for(size_t i = 0; i < count; ++i){
+        for(auto& c:block)
+            c = gen() % 4;
+        for(auto& arena:*arenas)
+            arena->push_back(block.data());
+    }
+    const std::vector<sort_mode> modes({sort_mode::stable, sort_mode::prefix, sort_mode::radix});
+    return seastar::do_for_each(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(modes.size()), [arenas, modes](size_t m){
+        auto& sync_arena = *(*arenas)[2 * m];
+        auto& async_arena = *(*arenas)[2 * m + 1];
+        sort_blocks(sync_arena, modes[m]);
+        return sort_blocks_async(async_arena, modes[m]).then([&sync_arena, &async_arena]{
+            BOOST_REQUIRE(async_arena.order() == sync_arena.order());
+        });
+    }).then([modes]{
+        // a large partition sorted in a thread yields: a task that reschedules itself runs many times before the sort is done.
+        // Without a yield it would run at most twice, before the thread starts and once the sort is done
+        set_record_size(64);
+        return seastar::do_for_each(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(modes.size()), [modes](size_t m){
+            const sort_mode mode = modes[m];
+            const size_t large_count = 200000;
+            std::mt19937 gen(64);
+            auto arena = std::make_shared<block_arena>(large_count);
+            std::vector<unsigned char> record(record_size);
+            for(size_t i = 0; i < large_count; ++i){
+                for(auto& c:record)
+                    c = gen() % 4;
+                arena->push_back(record.data());
+            }
+            auto ticks = std::make_shared<uint64_t>(0);
+            auto ticks_when_sorted = std::make_shared<uint64_t>(0);
+            auto done = std::make_shared<bool>(false);
+            auto ticker = seastar::do_until([done]{ return *done; }, [ticks]{
+                return seastar::later().then([ticks]{ ++*ticks; });
+            });
+            auto sorted = sort_blocks_async(*arena, mode).finally([ticks, ticks_when_sorted, done]{
+                *ticks_when_sorted = *ticks;
+                *done = true;
+            });
+            return seastar::when_all_succeed(std::move(sorted), std::move(ticker)).then([arena, ticks_when_sorted]{
+                BOOST_REQUIRE(*ticks_when_sorted > 2);
+                BOOST_REQUIRE(std::is_sorted(arena->order().begin(), arena->order().end(), [&arena](uint32_t a, uint32_t b){
+                    return compare_blocks(arena->slot(a), arena->slot(b)) < 0;
+                }));
+            });
+        });
+    }).finally([arenas]{
+        set_record_size(block_size);
+    });
+}
+
+// any supported compare kernel agrees with the scalar compare on any length and mismatch position
+SEASTAR_TEST_CASE(test_compare_kernels) {
+    auto sign = [](int x){ return (x > 0) - (x < 0); };
+    std::mt19937 gen(1);
+    std::vector<unsigned char> a(block_size), b(block_size);
+    const std::vector<size_t> lengths({0, 1, 7, 8, 15, 16, 31, 32, 63, 64, 65, 100, 255, static_cast<size_t>(block_size)});
+    for(auto len:lengths){
+        for(size_t d = 0; d <= len; d += 1 + len / 64){
+            std::generate(a.begin(), a.begin() + len, [&gen]{ return static_cast<unsigned char>(gen()); });
+            std::copy(a.begin(), a.begin() + len, b.begin());
+            if(d < len)
+                b[d] = static_cast<unsigned char>(gen());
+            const int expected = sign(compare_bytes_scalar(a.data(), b.data(), len));
+            BOOST_REQUIRE(expected == sign(std::memcmp(a.data(), b.data(), len)));
+            for(auto &k:compare_kernels()){
+                if(!k.supported)
+                    continue;
+                BOOST_REQUIRE(sign(k.compare(a.data(), b.data(), len)) == expected);
+                BOOST_REQUIRE(sign(k.compare(b.data(), a.data(), len)) == -expected);
+            }
+            BOOST_REQUIRE(sign(compare_bytes(a.data(), b.data(), len)) == expected);
+        }
+    }
+    return seastar::make_ready_future<>();
+}
+
+// internal sort of the test pattern in partitions of 4 blocks, then merge of the sorted files
+SEASTAR_TEST_CASE(test_internal_sort_runs) {
+    static seastar::sstring fname(pattern_dir  + "/runs_test_pattern");
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+        BOOST_REQUIRE(runs.size() == 3);
+        BOOST_REQUIRE(runs[0].blocks == 4 && runs[1].blocks == 4 && runs[2].blocks == 3);
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_parallel_merge) {
+    static seastar::sstring fname(pattern_dir  + "/parallel_merge_test_pattern");
+    run_options opts;
+    opts.memory = 3 * block_size;
+    return write_test_pattern(fname).then([opts]{
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([](std::vector<run_info> runs){
+        return parallel_external_sort(fname, std::move(runs));
+    }).then([]{
+        return check_sorted_pattern(fname + ".sorted");
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_pipelined_runs) {
+    static seastar::sstring fname(pattern_dir  + "/pipelined_runs_test_pattern");
+    run_options opts;
+    opts.memory = 6 * block_size;
+    opts.partitions = 3;
+    return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+        // any partition holds memory/partitions blocks, runs are numbered in input order
+        BOOST_REQUIRE(runs.size() == 6);
+        for(size_t i = 0; i < runs.size(); ++i){
+            BOOST_REQUIRE(runs[i].name == fname + "." + std::to_string(i + 1));
+            BOOST_REQUIRE(runs[i].blocks == (i + 1 < runs.size() ? 2 : 1));
+        }
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_replacement_selection_runs) {
+    static seastar::sstring fname(pattern_dir  + "/replacement_runs_test_pattern");
+    static seastar::sstring sorted_fname(pattern_dir  + "/replacement_runs_sorted_test_pattern");
+    run_options opts;
+    opts.memory = 3 * block_size;
+    opts.generator = run_generator::replacement;
+    return write_test_pattern(sorted_fname, 0, test_pattern_sorted.size(), test_pattern_sorted).then([opts]{
+        return internal_sort(sorted_fname, 0, test_pattern_sorted.size(), sorted_fname, opts);
+    }).then([](std::vector<run_info> runs){
+        // sorted input gives a single run whatever the memory
+        BOOST_REQUIRE(runs.size() == 1 && runs[0].blocks == test_pattern_sorted.size());
+    }).then([opts]{
+        return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+            uint64_t blocks = 0;
+            for(auto& run:runs)
+                blocks += run.blocks;
+            BOOST_REQUIRE(blocks == test_pattern_unsorted.size());
+            // runs grow beyond the memory, partitions of 3 blocks would give 4 runs
+            BOOST_REQUIRE(runs.size() == 2 && runs[0].blocks == 7);
+        });
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_presorted_input) {
+    static seastar::sstring fname(pattern_dir  + "/presorted_test_pattern");
+    static std::vector<seastar::sstring> test_pattern_reversed(test_pattern_sorted.rbegin(), test_pattern_sorted.rend());
+    return write_test_pattern(fname).then([]{
+        return scan_input_order(fname);
+    }).then([](input_order order){
+        BOOST_REQUIRE(order == input_order::unsorted);
+        return write_test_pattern(fname, 0, test_pattern_sorted.size(), test_pattern_sorted);
+    }).then([]{
+        return scan_input_order(fname);
+    }).then([](input_order order){
+        BOOST_REQUIRE(order == input_order::ascending);
+        return write_test_pattern(fname, 0, test_pattern_reversed.size(), test_pattern_reversed);
+    }).then([]{
+        // small extents, the reversed extents are written at their mirror position
+        reader_options input;
+        input.extent_size = 4 * block_size;
+        return scan_input_order(fname, input).then([input](input_order order){
+            BOOST_REQUIRE(order == input_order::descending);
+            return copy_presorted(fname, order, input);
+        });
+    }).then([]{
+        return check_sorted_pattern(fname + ".sorted");
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_merge_plan) {
+    // the smallest windows of consecutive files are merged first
+    merge_plan plan = plan_merge({10, 1, 1, 10, 1, 1, 1}, 3);
+    BOOST_REQUIRE(plan.steps.size() == 2);
+    BOOST_REQUIRE(plan.steps[0].first == 4 && plan.steps[0].count == 3 && plan.steps[0].blocks == 3);
+    BOOST_REQUIRE(plan.steps[1].first == 0 && plan.steps[1].count == 3 && plan.steps[1].blocks == 12);
+    BOOST_REQUIRE(plan.io_blocks == 2 * (3 + 12 + 25));
+    BOOST_REQUIRE(plan_merge({1, 2, 3}, 3).steps.empty());
+
+    static seastar::sstring fname(pattern_dir  + "/merge_plan_test_pattern");
+    run_options opts;
+    opts.memory = 2 * block_size;
+    opts.partitions = 1;
+    sort_options merge_opts;
+    merge_opts.max_fan_in = 2;
+    return write_test_pattern(fname).then([opts]{
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([merge_opts](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == 6);
+        return reduce_runs(fname, std::move(runs), merge_opts);
+    }).then([merge_opts](std::vector<run_info> runs){
+        // the intermediate passes leave max_fan_in files for the last merge, no block is lost
+        BOOST_REQUIRE(runs.size() == 2);
+        BOOST_REQUIRE(runs[0].blocks + runs[1].blocks == test_pattern_unsorted.size());
+        BOOST_REQUIRE(std::any_of(runs.begin(), runs.end(), [](const run_info& run){
+            return run.name.find(".pass.") != seastar::sstring::npos;
+        }));
+        return external_sort(fname, std::move(runs), merge_opts);
+    }).then([]{
+        return check_sorted_pattern(fname + ".sorted");
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_resident_partition) {
+    static seastar::sstring fname(pattern_dir  + "/resident_test_pattern");
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    opts.keep_last = true;
+    return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+        // the last partition is merged from memory
+        BOOST_REQUIRE(runs.size() == 3 && !runs[0].resident && !runs[1].resident && runs[2].resident);
+        BOOST_REQUIRE(runs[2].resident->size() == 3);
+    }).then([opts]() mutable {
+        // the whole input fits the memory, no sorted file is written
+        opts.memory = test_pattern_unsorted.size() * block_size;
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname + ".fit", opts);
+    }).then([](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == 1 && runs[0].resident);
+        return external_sort(fname + ".fit", std::move(runs));
+    }).then([]{
+        return check_sorted_pattern(fname + ".fit.sorted");
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_front_coded_runs) {
+    static seastar::sstring fname(pattern_dir  + "/front_coded_test_pattern");
+    static std::vector<run_info> coded;
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    opts.spill = spill_format::front_coded;
+    return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+        BOOST_REQUIRE(runs.size() == 3);
+        for(auto& run:runs)
+            BOOST_REQUIRE(run.format == spill_format::front_coded);
+        coded = runs;
+    }).then([]{
+        // the blocks of the pattern are mostly zeros, the blocks of any sorted file are coded in a single page
+        return seastar::do_for_each(coded, [](const run_info& run){
+            return seastar::open_file_dma(run.name, seastar::open_flags::ro).then([blocks=run.blocks](seastar::file f){
+                return f.size().then([blocks](uint64_t size){
+                    BOOST_REQUIRE(size == datablock::spill_page_size);
+                }).finally([f]() mutable {
+                    return f.close().finally([f]{});
+                });
+            });
+        });
+    }).then([opts]() mutable {
+        // no saving is enough, the partitions are written raw
+        opts.max_spill_ratio = 0;
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([](std::vector<run_info> runs){
+        for(auto& run:runs)
+            BOOST_REQUIRE(run.format == spill_format::raw);
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_key_pointer_sort) {
+    static seastar::sstring fname(pattern_dir  + "/key_pointer_test_pattern");
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    opts.key_pointer = true;
+    return write_test_pattern(fname).then([opts]{
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == 3);
+        return key_pointer_merge(fname, std::move(runs));
+    }).then([]{
+        // the permutation holds the index of any block of the unsorted pattern
+        return read_blocks_from_file(fname + ".permutation", [](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == 1);
+            for(size_t i = 0; i < test_pattern_sorted.size(); ++i){
+                uint64_t source;
+                std::memcpy(&source, x.get() + i * sizeof(source), sizeof(source));
+                BOOST_REQUIRE(test_pattern_unsorted[source] == test_pattern_sorted[i]);
+            }
+        });
+    }).then([]{
+        return gather_blocks(fname);
+    }).then([]{
+        return check_sorted_pattern(fname + ".sorted");
+    }).then([opts]{
+        // the keys of the records share more than key_record_key_size bytes,
+        // the merge resolves them by reading the blocks they point to
+        static std::vector<seastar::sstring> colliding;
+        static std::vector<seastar::sstring> colliding_sorted;
+        const std::string prefix(key_record_key_size + 4, 'k');
+        colliding.clear();
+        for(auto suffix:{"5", "3", "9", "", "1", "7", "2", "8", "0", "4", "6", "b", "a"})
+            colliding.push_back(seastar::sstring(prefix + suffix));
+        colliding_sorted = colliding;
+        std::sort(colliding_sorted.begin(), colliding_sorted.end());
+        return write_test_pattern(fname, 0, colliding.size(), colliding).then([opts]{
+            return internal_sort(fname, 0, colliding.size(), fname, opts);
+        }).then([](std::vector<run_info> runs){
+            BOOST_REQUIRE(runs.size() == 4);
+            return key_pointer_merge(fname, std::move(runs));
+        }).then([]{
+            return gather_blocks(fname);
+        }).then([]{
+            return read_blocks_from_file(fname + ".sorted", [](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+                BOOST_REQUIRE(blocks_tot == colliding_sorted.size());
+                const auto& expected = colliding_sorted[block_index];
+                BOOST_REQUIRE(std::equal(expected.begin(), expected.end(), x.get()));
+                BOOST_REQUIRE(std::all_of(x.get() + expected.size(), x.get() + block_size, [](unsigned char c){ return c == 0; }));
+            });
+        });
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+// records of 64 bytes packed 64 per block, the file is not a whole number of blocks
+SEASTAR_TEST_CASE(test_record_size) {
+    BOOST_REQUIRE_THROW(set_record_size(48), std::invalid_argument);
+    BOOST_REQUIRE_THROW(set_record_size(2 * block_size), std::invalid_argument);
+    for(auto& k:fixed_compare_kernels()){
+        if(!k.supported)
+            continue;
+        std::vector<unsigned char> a(k.width, 'a'), b(k.width, 'a');
+        BOOST_REQUIRE(k.compare(a.data(), b.data()) == 0);
+        b[k.width - 1] = 'b';
+        BOOST_REQUIRE(k.compare(a.data(), b.data()) < 0 && k.compare(b.data(), a.data()) > 0);
+    }
+
+    static seastar::sstring fname(pattern_dir  + "/record_size_test_pattern");
+    static seastar::sstring reversed_fname(pattern_dir  + "/record_size_reversed_test_pattern");
+    set_record_size(64);
+    const size_t count = 201;
+    std::mt19937 gen(64);
+    auto records = std::make_shared<blocks_vector>();
+    for(size_t i = 0; i < count; ++i){
+        std::vector<unsigned char> record(record_size);
+        for(auto& c:record)
+            c = 'a' + gen() % 3;
+        records->push_back(make_block(record.begin(), record.end()));
+    }
+    auto expected = std::make_shared<std::vector<std::vector<unsigned char>>>();
+    for(auto& record:*records)
+        expected->emplace_back(record.get(), record.get() + record_size);
+    std::sort(expected->begin(), expected->end());
+
+    run_options opts;
+    opts.memory = 16 * record_size;
+    opts.partitions = 1;
+    auto check_sorted = [expected](seastar::sstring sorted_fname){
+        return read_blocks_from_file(sorted_fname, [expected](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == expected->size());
+            BOOST_REQUIRE(std::equal(x.get(), x.get() + record_size, (*expected)[block_index].begin()));
+        });
+    };
+    return write_blocks(*records, fname).then([opts]{
+        return internal_sort(fname, 0, count, fname, opts);
+    }).then([](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == (count + 15) / 16);
+        return external_sort(fname, std::move(runs));
+    }).then([check_sorted]{
+        return check_sorted(fname + ".sorted");
+    }).then([records, expected]{
+        // the reverse sorted records are copied by extents of 64 records
+        records->clear();
+        for(auto it = expected->rbegin(); it != expected->rend(); ++it)
+            records->push_back(make_block(it->begin(), it->end()));
+        return write_blocks(*records, reversed_fname);
+    }).then([check_sorted]{
+        reader_options input;
+        input.extent_size = block_size;
+        return copy_presorted(reversed_fname, input_order::descending, input).then([check_sorted]{
+            return check_sorted(reversed_fname + ".sorted");
+        });
+    }).then([]{
+        return seastar::open_file_dma(fname + ".sorted", seastar::open_flags::ro).then([](seastar::file f){
+            return f.size().then([](uint64_t size){
+                BOOST_REQUIRE(size == count * record_size);
+            }).finally([f]() mutable {
+                return f.close().finally([f]{});
+            });
+        });
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    }).finally([records]{
+        set_record_size(block_size);
+    });
+}
+
+SEASTAR_TEST_CASE(test_metrics) {
+    static seastar::sstring fname(pattern_dir  + "/metrics_test_pattern");
+    using sort_metrics::phase;
+    auto& stats = sort_metrics::local_stats();
+    const auto before = std::make_shared<sort_metrics::shard_stats>(stats);
+    const uint64_t sort_compares = datablock::sort_compares();
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    return sort_test_pattern(fname, opts, sort_options(), [](const std::vector<run_info>& runs){
+        BOOST_REQUIRE(runs.size() == 3);
+    }).then([before, sort_compares]{
+        auto& stats = sort_metrics::local_stats();
+        const uint64_t bytes = test_pattern_unsorted.size() * block_size;
+        auto delta = [&stats, before](phase p, bool read){
+            const size_t i = static_cast<size_t>(p);
+            return read ? stats.phases[i].bytes_read - before->phases[i].bytes_read
+                        : stats.phases[i].bytes_written - before->phases[i].bytes_written;
+        };
+        BOOST_REQUIRE(delta(phase::runs, true) == bytes && delta(phase::runs, false) == bytes);
+        BOOST_REQUIRE(delta(phase::merge, true) >= bytes && delta(phase::merge, false) == bytes);
+        BOOST_REQUIRE(stats.read_latency.count() > before->read_latency.count());
+        BOOST_REQUIRE(stats.write_latency.count() > before->write_latency.count());
+        BOOST_REQUIRE(stats.reads_in_flight == 0 && stats.writes_in_flight == 0 && stats.max_reads_in_flight > 0);
+        BOOST_REQUIRE(stats.partition_sort_time.count() == before->partition_sort_time.count() + 3);
+        BOOST_REQUIRE(stats.run_stalls.size() == before->run_stalls.size() + 3);
+        BOOST_REQUIRE(stats.merge_compares > before->merge_compares && datablock::sort_compares() > sort_compares);
+        BOOST_REQUIRE(stats.peak_memory > 0);
+        return sort_metrics::json_summary();
+    }).then([](seastar::sstring summary){
+        BOOST_REQUIRE(summary.find("\"merge\": {\"bytes_read\"") != seastar::sstring::npos);
+        BOOST_REQUIRE(summary.find("{\"name\": \"" + fname + ".1\", \"shard\": 0, \"ms\": ") != seastar::sstring::npos);
+        BOOST_REQUIRE(summary.find("\"max_shard_peak_memory\": ") != seastar::sstring::npos);
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_workload) {
+    static seastar::sstring fname(pattern_dir  + "/workload_test_pattern");
+    const uint64_t count = 1000;
+    for(auto name:{"uniform", "zipf", "duplicates", "common-prefix", "nearly-sorted", "interleaved-runs"}){
+        workload::workload_options opts;
+        opts.dist = workload::parse_distribution(name);
+        opts.distinct_keys = 16;
+        opts.runs = 4;
+        const workload::record_generator generator(opts);
+        // any chunk generates the same records
+        std::vector<unsigned char> whole(count * record_size), chunks(count * record_size);
+        generator.fill(0, count, whole.data());
+        for(uint64_t first = 0; first < count; first += 37)
+            generator.fill(first, std::min<uint64_t>(37, count - first), chunks.data() + first * record_size);
+        BOOST_REQUIRE(whole == chunks);
+
+        std::set<std::vector<unsigned char>> distinct;
+        for(uint64_t i = 0; i < count; ++i)
+            distinct.emplace(whole.data() + i * record_size, whole.data() + (i + 1) * record_size);
+        if(opts.dist == workload::distribution::duplicates)
+            BOOST_REQUIRE(distinct.size() <= opts.distinct_keys);
+        else
+            BOOST_REQUIRE(distinct.size() == count);
+        if(opts.dist == workload::distribution::interleaved_runs){
+            for(uint64_t i = opts.runs; i < count; ++i)
+                BOOST_REQUIRE(compare_bytes(whole.data() + (i - opts.runs) * record_size, whole.data() + i * record_size, record_size) < 0);
+        }
+    }
+    BOOST_REQUIRE_THROW(workload::parse_distribution("gaussian"), std::invalid_argument);
+
+    workload::workload_options opts;
+    opts.dist = workload::distribution::zipf;
+    run_options sort_opts;
+    sort_opts.memory = 64 * block_size;
+    sort_opts.partitions = 1;
+    auto previous = std::make_shared<std::vector<unsigned char>>();
+    return workload::write_workload(fname, 300, opts).then([sort_opts]{
+        return internal_sort(fname, 0, 300, fname, sort_opts);
+    }).then([](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == 5);
+        return external_sort(fname, std::move(runs));
+    }).then([previous]{
+        return read_blocks_from_file(fname + ".sorted", [previous](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == 300);
+            if(!previous->empty())
+                BOOST_REQUIRE(compare_blocks(previous->data(), x.get()) <= 0);
+            previous->assign(x.get(), x.get() + record_size);
+        });
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_verify_sorted) {
+    static seastar::sstring fname(pattern_dir  + "/verify_test_pattern");
+    static seastar::sstring sorted_fname(fname + ".sorted");
+    return write_test_pattern(fname).then([]{
+        return write_test_pattern(sorted_fname, 0, test_pattern_sorted.size(), test_pattern_sorted);
+    }).then([]{
+        return verify_sorted(fname, sorted_fname);
+    }).then([](verify_result result){
+        BOOST_REQUIRE(result.ok());
+        BOOST_REQUIRE(result.input_blocks == test_pattern_unsorted.size() && result.output_blocks == test_pattern_sorted.size());
+        // the input is a permutation of itself, "25" follows "External sorting..."
+        return verify_sorted(fname, fname);
+    }).then([](verify_result result){
+        BOOST_REQUIRE(result.permutation && !result.sorted() && result.first_unsorted == 1);
+        // a block is missing
+        return write_test_pattern(sorted_fname, 0, test_pattern_sorted.size() - 1, test_pattern_sorted);
+    }).then([]{
+        return verify_sorted(fname, sorted_fname);
+    }).then([](verify_result result){
+        BOOST_REQUIRE(result.sorted() && !result.permutation);
+        // the only inversion is at the first block of the last of 3 ranges, 11 * 2 / 3 = 7,
+        // it's found by the compare of the last block of a range with the first one of the next
+        static std::vector<seastar::sstring> swapped;
+        swapped = test_pattern_sorted;
+        std::swap(swapped[6], swapped[7]);
+        return write_test_pattern(sorted_fname, 0, swapped.size(), swapped);
+    }).then([]{
+        return verify_sorted(fname, sorted_fname, file_utils::reader_options(), 3);
+    }).then([](verify_result result){
+        BOOST_REQUIRE(result.permutation && result.first_unsorted == 7);
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+// feed the input to stream_internal_sort by a pipe and merge the sorted files to another pipe,
+// check_runs checks the sorted files before the merge, the future resolves to the bytes of the merge
+template <typename CheckRuns>
+seastar::future<std::shared_ptr<std::vector<unsigned char>>> sort_through_pipes(seastar::sstring fname,
+                                                                               std::shared_ptr<std::vector<unsigned char>> input,
+                                                                               run_options opts, sort_options merge_opts,
+                                                                               CheckRuns check_runs) {
+    int in_fds[2];
+    int out_fds[2];
+    BOOST_REQUIRE(::pipe2(in_fds, O_NONBLOCK) == 0 && ::pipe2(out_fds, O_NONBLOCK) == 0);
+    auto in_read = std::make_shared<seastar::pollable_fd>(seastar::file_desc::from_fd(in_fds[0]));
+    auto in_write = std::make_shared<seastar::pollable_fd>(seastar::file_desc::from_fd(in_fds[1]));
+    auto out_read = std::make_shared<seastar::pollable_fd>(seastar::file_desc::from_fd(out_fds[0]));
+    auto out_write = std::make_shared<seastar::pollable_fd>(seastar::file_desc::from_fd(out_fds[1]));
+
+    auto output = std::make_shared<std::vector<unsigned char>>();
+    auto feed = in_write->write_all(input->data(), input->size()).finally([in_write, input]{
+        in_write->close();
+    });
+    auto sort = stream_internal_sort(*in_read, fname, opts).then([fname, out_write, merge_opts, check_runs](std::vector<run_info> runs){
+        check_runs(runs);
+        return external_sort(fname, std::move(runs), *out_write, merge_opts);
+    }).finally([in_read, out_write]{
+        // the reader sees the end of the stream even when the sort failed
+        out_write->close();
+    });
+    auto collect = seastar::do_with(std::vector<char>(block_size), false, [out_read, output](auto& buf, auto& eof){
+        return seastar::do_until([&eof]{ return eof; }, [&buf, &eof, out_read, output]{
+            return out_read->read_some(buf.data(), buf.size()).then([&buf, &eof, output](size_t n){
+                eof = n == 0;
+                output->insert(output->end(), buf.begin(), buf.begin() + n);
+            });
+        });
+    });
+    return seastar::when_all_succeed(std::move(feed), std::move(sort), std::move(collect)).then([output]{
+        return output;
+    });
+}
+
+// the blocks of the unsorted pattern back to back
+std::shared_ptr<std::vector<unsigned char>> test_pattern_stream() {
+    auto input = std::make_shared<std::vector<unsigned char>>();
+    for(auto& s:test_pattern_unsorted){
+        std::vector<unsigned char> block(block_size, 0);
+        std::copy(s.begin(), s.end(), block.begin());
+        input->insert(input->end(), block.begin(), block.end());
+    }
+    return input;
+}
+
+SEASTAR_TEST_CASE(test_stream_sort) {
+    static seastar::sstring fname(pattern_dir  + "/stream_test_pattern");
+    // the unsorted pattern followed by a partial block, that is padded by zeros
+    auto input = test_pattern_stream();
+    std::vector<std::vector<unsigned char>> expected;
+    for(auto& s:test_pattern_unsorted){
+        expected.emplace_back(block_size, 0);
+        std::copy(s.begin(), s.end(), expected.back().begin());
+    }
+    const std::string tail("zz partial block");
+    input->insert(input->end(), tail.begin(), tail.end());
+    expected.emplace_back(block_size, 0);
+    std::copy(tail.begin(), tail.end(), expected.back().begin());
+    std::sort(expected.begin(), expected.end());
+
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    opts.input.extent_size = 3 * block_size;
+    return sort_through_pipes(fname, input, opts, sort_options(), [](const std::vector<run_info>& runs){
+        BOOST_REQUIRE(runs.size() == 3);
+    }).then([expected](std::shared_ptr<std::vector<unsigned char>> output){
+        BOOST_REQUIRE(output->size() == expected.size() * block_size);
+        for(size_t i = 0; i < expected.size(); ++i)
+            BOOST_REQUIRE(std::equal(expected[i].begin(), expected[i].end(), output->begin() + i * block_size));
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
+
+SEASTAR_TEST_CASE(test_limit) {
+    static seastar::sstring fname(pattern_dir  + "/limit_test_pattern");
+    // the first limit blocks of the sorted file are the first blocks of the sorted pattern
+    auto check_limited = [](uint64_t limit){
+        return read_blocks_from_file(fname + ".sorted", [limit](blocks_ptr &&x, uint64_t block_index, uint64_t blocks_tot){
+            BOOST_REQUIRE(blocks_tot == limit);
+            BOOST_REQUIRE(std::equal(test_pattern_sorted[block_index].begin(), test_pattern_sorted[block_index].end(), x.get()));
+        });
+    };
+    auto check_stream = [](const std::vector<unsigned char>& output){
+        BOOST_REQUIRE(output.size() == 3 * block_size);
+        for(size_t i = 0; i < 3; ++i)
+            BOOST_REQUIRE(std::equal(test_pattern_sorted[i].begin(), test_pattern_sorted[i].end(), output.begin() + i * block_size));
+    };
+    // 3 blocks fit the memory, they are kept by the bounded heap
+    run_options opts;
+    opts.memory = 4 * block_size;
+    opts.partitions = 1;
+    opts.limit = 3;
+    sort_options merge_opts;
+    merge_opts.limit = opts.limit;
+    return write_test_pattern(fname).then([opts]{
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+    }).then([merge_opts](std::vector<run_info> runs){
+        BOOST_REQUIRE(runs.size() == 1 && runs[0].blocks == 3);
+        return external_sort(fname, std::move(runs), merge_opts);
+    }).then([check_limited]{
+        return check_limited(3);
+    }).then([opts, merge_opts]() mutable {
+        // 3 blocks don't fit the memory, the replacement selection runs are truncated and the merge stops at the limit
+        opts.memory = 2 * block_size;
+        opts.generator = run_generator::replacement;
+        return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts).then([merge_opts](std::vector<run_info> runs){
+            BOOST_REQUIRE(runs.size() > 1);
+            for(auto& run:runs)
+                BOOST_REQUIRE(run.blocks <= 3);
+            return external_sort(fname, std::move(runs), merge_opts);
+        });
+    }).then([check_limited]{
+        return check_limited(3);
+    }).then([]{
+        // the copy of a presorted file stops at the limit too
+        return write_test_pattern(fname, 0, test_pattern_sorted.size(), test_pattern_sorted);
+    }).then([merge_opts]{
+        return copy_presorted(fname, input_order::ascending, reader_options(), merge_opts);
+    }).then([check_limited]{
+        return check_limited(3);
+    }).then([]{
+        // a reverse sorted file is copied from its end, the copy stops at the limit as well
+        static std::vector<seastar::sstring> reversed(test_pattern_sorted.rbegin(), test_pattern_sorted.rend());
+        return write_test_pattern(fname, 0, reversed.size(), reversed);
+    }).then([merge_opts]{
+        return copy_presorted(fname, input_order::descending, reader_options(), merge_opts);
+    }).then([check_limited]{
+        return check_limited(3);
+    }).then([opts, merge_opts]() mutable {
+        // 3 blocks don't fit the memory, the partitions of 2 blocks are merged 2 by 2 and the intermediate merges stop at the limit
+        opts.memory = 2 * block_size;
+        opts.generator = run_generator::partition;
+        merge_opts.max_fan_in = 2;
+        return write_test_pattern(fname).then([opts]{
+            return internal_sort(fname, 0, test_pattern_unsorted.size(), fname, opts);
+        }).then([merge_opts](std::vector<run_info> runs){
+            BOOST_REQUIRE(runs.size() == 6);
+            return reduce_runs(fname, std::move(runs), merge_opts);
+        }).then([merge_opts](std::vector<run_info> runs){
+            BOOST_REQUIRE(runs.size() == 2);
+            for(auto& run:runs)
+                BOOST_REQUIRE(run.blocks <= 3);
+            BOOST_REQUIRE(std::any_of(runs.begin(), runs.end(), [](const run_info& run){
+                return run.blocks == 3 && run.name.find(".pass.") != seastar::sstring::npos;
+            }));
+            return external_sort(fname, std::move(runs), merge_opts);
+        });
+    }).then([check_limited]{
+        return check_limited(3);
+    }).then([opts, merge_opts]{
+        // 3 blocks fit the memory, the stream goes through the bounded heap and the merge to a stream stops at the limit
+        return sort_through_pipes(fname, test_pattern_stream(), opts, merge_opts, [](const std::vector<run_info>& runs){
+            BOOST_REQUIRE(runs.size() == 1 && runs[0].blocks == 3);
+        });
+    }).then([check_stream](std::shared_ptr<std::vector<unsigned char>> output){
+        check_stream(*output);
+    }).then([opts, merge_opts]() mutable {
+        // 3 blocks don't fit the memory, the stream fills partitions of 2 blocks and the merge to a stream stops at the limit
+        opts.memory = 2 * block_size;
+        return sort_through_pipes(fname, test_pattern_stream(), opts, merge_opts, [](const std::vector<run_info>& runs){
+            BOOST_REQUIRE(runs.size() == 6);
+            for(auto& run:runs)
+                BOOST_REQUIRE(run.blocks <= 2);
+        });
+    }).then([check_stream](std::shared_ptr<std::vector<unsigned char>> output){
+        check_stream(*output);
+    }).handle_exception([](std::exception_ptr e) {
+        TEST_HANDLE_EXCEPTION;
+    });
+}
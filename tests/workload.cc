@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workload.hh"
+#include <seastar/core/thread.hh>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace workload {
+
+static const char* distribution_names[] = {"uniform", "zipf", "duplicates", "common-prefix", "nearly-sorted", "interleaved-runs"};
+
+distribution parse_distribution(const std::string& name)
+{
+    for(size_t i = 0; i < sizeof(distribution_names) / sizeof(distribution_names[0]); ++i){
+        if(name == distribution_names[i])
+            return static_cast<distribution>(i);
+    }
+    throw std::invalid_argument("unknown workload " + name);
+}
+
+const char* distribution_name(distribution dist)
+{
+    return distribution_names[static_cast<size_t>(dist)];
+}
+
+// splitmix64 finalizer, a bijection of the 64 bits integers
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// random bytes of the stream state
+static void fill_random(uint64_t state, unsigned char* out, size_t len)
+{
+    for(size_t i = 0; i < len; i += sizeof(uint64_t)){
+        const uint64_t r = mix(state + i);
+        std::memcpy(out + i, &r, std::min(sizeof(r), len - i));
+    }
+}
+
+static void store_key(uint64_t key, unsigned char* out)
+{
+    for(size_t i = 0; i < sizeof(key); ++i)
+        out[i] = static_cast<unsigned char>(key >> (56 - 8 * i));
+}
+
+// fraction in [0, 1] of the 64 bits range, 2^64 is out of uint64_t and the cast of it would be undefined
+static uint64_t scale_to_u64(double fraction)
+{
+    const double two_pow_64 = 18446744073709551616.0;
+    const double scaled = fraction * two_pow_64;
+    return scaled >= two_pow_64 ? UINT64_MAX : static_cast<uint64_t>(scaled);
+}
+
+record_generator::record_generator(workload_options opts):_opts(opts)
+{
+    if(_opts.dist == distribution::zipf){
+        const uint64_t keys = std::max<uint64_t>(_opts.distinct_keys, 1);
+        std::vector<double> weights(keys);
+        double total = 0;
+        for(uint64_t k = 0; k < keys; ++k)
+            total += weights[k] = 1.0 / std::pow(static_cast<double>(k + 1), _opts.skew);
+        double cumulated = 0;
+        _zipf_cdf.reserve(keys);
+        for(uint64_t k = 0; k < keys; ++k){
+            cumulated += weights[k];
+            _zipf_cdf.push_back(k + 1 == keys ? UINT64_MAX : scale_to_u64(cumulated / total));
+        }
+    }
+    if(_opts.dist == distribution::interleaved_runs){
+        for(size_t r = 0; r < std::max<size_t>(_opts.runs, 1); ++r){
+            const uint64_t x = mix(_opts.seed ^ mix(r));
+            _runs.emplace_back(x >> 16, 1 + (x & 0xffff));
+        }
+    }
+}
+
+uint64_t record_generator::zipf_rank(uint64_t u) const
+{
+    return std::lower_bound(_zipf_cdf.begin(), _zipf_cdf.end(), u) - _zipf_cdf.begin();
+}
+
+void record_generator::fill(uint64_t first, uint64_t count, unsigned char* out) const
+{
+    const size_t len = datablock::record_size;
+    for(uint64_t i = first; i < first + count; ++i, out += len){
+        const uint64_t state = mix(_opts.seed ^ mix(i));
+        switch(_opts.dist){
+        case distribution::uniform:
+            fill_random(state, out, len);
+            break;
+        case distribution::zipf:
+            // the rank is scrambled, so the popular keys are spread over the key space
+            fill_random(state, out, len);
+            store_key(mix(_opts.seed + zipf_rank(mix(state))), out);
+            break;
+        case distribution::duplicates:
+            fill_random(mix(_opts.seed) ^ mix(state % std::max<uint64_t>(_opts.distinct_keys, 1)), out, len);
+            break;
+        case distribution::common_prefix: {
+            // the last 8 bytes of the record are random at least
+            const size_t prefix = std::min(_opts.prefix_length, len - sizeof(uint64_t));
+            std::fill(out, out + prefix, '0');
+            fill_random(state, out + prefix, len - prefix);
+            break;
+        }
+        case distribution::nearly_sorted: {
+            fill_random(state, out, len);
+            const bool displaced = static_cast<double>(mix(state) >> 11) / 9007199254740992.0 < _opts.disorder;
+            if(!displaced)
+                store_key(i, out);
+            break;
+        }
+        case distribution::interleaved_runs: {
+            const auto& run = _runs[i % _runs.size()];
+            fill_random(state, out, len);
+            store_key(run.first + (i / _runs.size()) * run.second, out);
+            break;
+        }
+        }
+    }
+}
+
+seastar::future<> write_workload(seastar::sstring fname, uint64_t records, workload_options opts, file_utils::writer_options output)
+{
+    return seastar::async([fname, records, opts, output]{
+        const record_generator generator(opts);
+        seastar::file f = seastar::open_file_dma(fname, seastar::open_flags::rw|seastar::open_flags::create|seastar::open_flags::truncate).get0();
+        file_utils::block_writer writer(std::move(f), 0, output);
+        const uint64_t chunk = std::max<uint64_t>(1, output.buffer_size / datablock::record_size);
+        std::vector<unsigned char> buffer(chunk * datablock::record_size);
+        for(uint64_t first = 0; first < records; first += chunk){
+            const uint64_t count = std::min(chunk, records - first);
+            generator.fill(first, count, buffer.data());
+            writer.write(buffer.data(), count * datablock::record_size).get();
+        }
+        writer.close().get();
+    });
+}
+
+}
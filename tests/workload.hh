@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2019 Alessandro Arrabito
+ */
+
+/*
+ * This file is part of bigsort.
+ *
+ * bigsort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bigsort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bigsort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <seastar/core/future.hh>
+#include <seastar/core/sstring.hh>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../file_utils.hh"
+
+namespace workload {
+
+// distribution of the records of a workload, the key of a record is its first 8 bytes as big-endian integer
+enum class distribution {
+    // random bytes
+    uniform,
+    // keys drawn from distinct_keys keys by a Zipf law of exponent skew, records with equal keys differ in their payload
+    zipf,
+    // records drawn from distinct_keys records, so most records have equal copies
+    duplicates,
+    // records sharing their first prefix_length bytes, up to the record size less 8 bytes, followed by random bytes as genbigfile patterns
+    common_prefix,
+    // ascending keys where a disorder fraction of the records has a random key
+    nearly_sorted,
+    // runs ascending sequences interleaved record by record
+    interleaved_runs
+};
+
+// parse a distribution name, throws std::invalid_argument for an unknown name
+distribution parse_distribution(const std::string& name);
+const char* distribution_name(distribution dist);
+
+struct workload_options
+{
+    distribution dist = distribution::uniform;
+    uint64_t seed = 1;
+    double skew = 1.0;
+    uint64_t distinct_keys = 1024;
+    size_t prefix_length = 64;
+    double disorder = 0.01;
+    size_t runs = 16;
+};
+
+// Generator of the records of a workload of datablock::record_size bytes. Any record is a function of the seed and
+// of its index only, so a workload of any size is generated in any order and by any chunk with the same result.
+class record_generator
+{
+public:
+    explicit record_generator(workload_options opts);
+
+    // write the records [first, first + count) to out
+    void fill(uint64_t first, uint64_t count, unsigned char* out) const;
+
+private:
+    uint64_t zipf_rank(uint64_t u) const;
+
+    workload_options _opts;
+    // cumulated Zipf weights of the keys scaled to 2^64
+    std::vector<uint64_t> _zipf_cdf;
+    // base and step of any interleaved run
+    std::vector<std::pair<uint64_t, uint64_t>> _runs;
+};
+
+// write a file of records records of the workload by the write-behind writer
+seastar::future<> write_workload(seastar::sstring fname, uint64_t records, workload_options opts,
+                                 file_utils::writer_options output = file_utils::writer_options());
+
+}